@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 MusicStaves Toolkit contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Microbenchmark for the projection cross-correlation of the Fujinaga
+ * skew estimation: compares Aomr::cross_correlate against the original
+ * scalar implementation Aomr::cross_correlate_reference and checks that
+ * both return the same offsets.
+ *
+ * See the Readme in this directory for how to compile and run it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cross_correlation.hpp"
+
+using namespace Aomr;
+
+// Creates the projection of a vertical strip of a synthetic score page:
+// staves of five lines every *staff_distance* rows, shifted by *skew*,
+// plus some random noise from musical symbols (*density* of the rows).
+static ProjVector make_projection(int n, int width, int skew, double density) {
+  ProjVector proj(n, 0);
+  int staff_distance = 240;
+  for (int top = 100 + skew; top + 60 < n; top += staff_distance)
+    for (int line = 0; line < 5; ++line)
+      for (int h = 0; h < 3; ++h)
+        if (top + line * 15 + h >= 0)
+          proj[top + line * 15 + h] = width - rand() % 4;
+  for (int i = 0; i < n; ++i)
+    if (rand() < density * RAND_MAX)
+      proj[i] += rand() % (width / 2 + 1);
+  return proj;
+}
+
+static double seconds() {
+  return double(clock()) / CLOCKS_PER_SEC;
+}
+
+int main() {
+  const int heights[] = {3500, 7000, 14000};
+  const int shifts[] = {4, 12, 40, 120};
+  const double densities[] = {0.05, 0.5};
+  int strips = 200;
+  int failures = 0;
+
+  srand(42);
+  printf("%6s %5s %7s %12s %12s %8s\n", "rows", "shift", "density",
+         "old [us]", "new [us]", "speedup");
+  for (size_t h = 0; h < sizeof(heights) / sizeof(int); ++h) {
+    for (size_t s = 0; s < sizeof(shifts) / sizeof(int); ++s) {
+      for (size_t d = 0; d < sizeof(densities) / sizeof(double); ++d) {
+        int n = heights[h], max_shift = shifts[s];
+        // build a chain of strips as find_skew would see them
+        std::vector<ProjVector> projs;
+        for (int i = 0; i < strips; ++i)
+          projs.push_back(make_projection(n, 40, (i * 7) / 10 % max_shift, densities[d]));
+        ProjVector accumulated = make_projection(n, 40 * strips / 4, 0, densities[d]);
+
+        std::vector<int> old_offsets(strips), new_offsets(strips);
+        double t0 = seconds();
+        for (int i = 0; i < strips; ++i)
+          old_offsets[i] = cross_correlate_reference(&accumulated, &projs[i], i % 3 - 1, max_shift);
+        double t1 = seconds();
+        for (int i = 0; i < strips; ++i)
+          new_offsets[i] = cross_correlate(&accumulated, &projs[i], i % 3 - 1, max_shift);
+        double t2 = seconds();
+
+        for (int i = 0; i < strips; ++i)
+          if (old_offsets[i] != new_offsets[i])
+            ++failures;
+
+        double old_us = (t1 - t0) * 1e6 / strips, new_us = (t2 - t1) * 1e6 / strips;
+        printf("%6d %5d %7.2f %12.1f %12.1f %8.2f\n", n, max_shift, densities[d],
+               old_us, new_us, new_us > 0 ? old_us / new_us : 0.0);
+      }
+    }
+  }
+
+  if (failures) {
+    printf("ERROR: %d offsets differ from the reference implementation\n", failures);
+    return 1;
+  }
+  printf("all offsets identical to the reference implementation\n");
+  return 0;
+}
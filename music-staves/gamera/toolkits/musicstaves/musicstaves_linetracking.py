@@ -31,7 +31,7 @@ from gamera.toolkits.musicstaves.musicstaves import StaffObj
 from gamera.toolkits.musicstaves.stafffinder_dalitz \
      import StaffFinder_dalitz
 from gamera.toolkits.musicstaves.plugins.line_tracking \
-     import remove_line_around_skeletons
+     import remove_line_around_skeletons, SkeletonSet
 
 #----------------------------------------------------------------
 
@@ -202,6 +202,9 @@ Conference on Image Processing and its Applications (1997)
         # Save for later use
         orig_image = self.image.image_copy()
 
+        # Convert the skeletons only once for all line tracking plugins
+        skeletons = SkeletonSet(self.stafffinder.get_skeleton())
+
         if crossing_symbols == 'all':
 
             if symbol_criterion == 'runlength':
@@ -230,7 +233,7 @@ Conference on Image Processing and its Applications (1997)
                 # algorithm to the rescue image
                 rescue_image.rescue_stafflines_using_secondchord( \
                     notallruns, \
-                    self.stafffinder.get_skeleton(), \
+                    skeletons, \
                     self.staffline_height, \
                     self.staffspace_height, \
                     threshold, \
@@ -258,7 +261,7 @@ Conference on Image Processing and its Applications (1997)
                 # algorithm to the rescue image
                 rescue_image.rescue_stafflines_using_mask( \
                     self.image, \
-                    self.stafffinder.get_skeleton(), \
+                    skeletons, \
                     self.staffline_height, \
                     threshold)
 
@@ -373,7 +376,7 @@ Conference on Image Processing and its Applications (1997)
         else:
             removethreshold = int(self.staffline_height * 1.3) + 1
         self.image.remove_line_around_skeletons( \
-            self.stafffinder.get_skeleton(), \
+            skeletons, \
             self.staffline_height, \
             removethreshold, \
             max_gap_height)
@@ -82,12 +82,13 @@ References:
       self.page = None
 
    def remove_staves(self, crossing_symbols='all', num_lines=5,
-                     skew_strip_width=0, max_skew=5.0, undo_deskew=False):
+                     skew_strip_width=0, max_skew=5.0, undo_deskew=False,
+                     workspace=None):
       """Detects and removes staff lines from a music/tablature image.
 
 Signature:
 
-  ``remove_staves(crossing_symbols='all', num_lines=5, skew_strip_width=0, max_skew=5.0, undo_deskew=False)``
+  ``remove_staves(crossing_symbols='all', num_lines=5, skew_strip_width=0, max_skew=5.0, undo_deskew=False, workspace=None)``
 
 with
 
@@ -97,8 +98,8 @@ with
     **Currently ignored**
 
   *num_lines*:
-    The number of stafflines in each staff.  (Autodetection of number of stafflines not yet
-    implemented).
+    The number of stafflines in each staff.  When 0, the number of stafflines is detected
+    for each staff separately.
 
   *skew_strip_width* = 0
     The width (in pixels) of vertical strips used to deskew the image.  Smaller values will
@@ -114,11 +115,17 @@ with
   *undo_deskew* = False
     since the fujinaga performs deskewing on the input image, it might be necessary
     to undo it, for evaluational reasons.
+
+  *workspace* = None
+    A ``FujinagaWorkspace`` (from the plugin module staff_removal_fujinaga) that
+    keeps the temporary buffers between calls. This saves memory allocations
+    when many images of the same size are processed.
 """
       crossing_symbols = ['all', 'bars', 'none'].index(crossing_symbols)
       deskewed, self.image, self.page = staff_removal_fujinaga.find_and_remove_staves_fujinaga(
          self.image, crossing_symbols, num_lines, self.staffline_height, self.staffspace_height,
-         skew_strip_width, max_skew, undo_deskew = undo_deskew)
+         skew_strip_width, max_skew, undo_deskew = undo_deskew,
+         workspace = workspace)
       return self.image
 
    def get_staffpos(self, x=0):
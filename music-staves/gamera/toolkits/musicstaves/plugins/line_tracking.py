@@ -23,6 +23,66 @@
 
 from gamera.plugin import *
 import _line_tracking
+import array
+
+#----------------------------------------------------------------
+
+class SkeletonSet:
+    """Holds staff line skeletons in contiguous C++ arrays instead of
+nested Python lists. The line tracking plugins remove_line_around_skeletons_,
+rescue_stafflines_using_mask_, rescue_stafflines_using_secondchord_ and
+skeleton_list_to_image_ accept a SkeletonSet wherever they accept a
+skeleton list. A skeleton list is otherwise converted on every call, so
+that it pays to convert it once when it is used several times:
+
+.. code:: Python
+
+   skeletons = SkeletonSet(stafffinder.get_skeleton())
+   rescue_image.rescue_stafflines_using_mask(image, skeletons, slh, thr)
+   image.remove_line_around_skeletons(skeletons, slh, thr)
+
+*staves*
+   A nested list of skeletons (objects with the properties *left_x* and
+   *y_list*, like StafflineSkeleton), as returned by
+   StaffFinder.get_skeleton.
+"""
+    def __init__(self, staves=[], _handle=None):
+        if _handle is None:
+            _handle = _line_tracking.create_skeleton_set(staves)
+        self.skeleton_set = _handle
+
+    def arrays(self):
+        """Returns the tuple *(staff_begin, left_x, y_begin, y)* of
+``array.array('i')``. Skeleton *i* starts at column *left_x[i]* and has
+the rows *y[y_begin[i]:y_begin[i+1]]*; staff *s* consists of the skeletons
+*staff_begin[s]* to *staff_begin[s+1]-1*.
+"""
+        result = []
+        for data in _line_tracking.skeleton_set_arrays(self.skeleton_set):
+            a = array.array('i')
+            a.fromstring(data)
+            result.append(a)
+        return tuple(result)
+
+    def to_list(self):
+        """Returns the skeletons as a nested list of StafflineSkeleton."""
+        from gamera.toolkits.musicstaves.stafffinder import StafflineSkeleton
+        staff_begin, left_x, y_begin, y = self.arrays()
+        staves = []
+        for s in range(len(staff_begin) - 1):
+            staff = []
+            for i in range(staff_begin[s], staff_begin[s+1]):
+                skel = StafflineSkeleton()
+                skel.left_x = left_x[i]
+                skel.y_list = y[y_begin[i]:y_begin[i+1]].tolist()
+                staff.append(skel)
+            staves.append(staff)
+        return staves
+
+def _skeleton_handle(skeletons):
+    if isinstance(skeletons, SkeletonSet):
+        return skeletons.skeleton_set
+    return skeletons
 
 #----------------------------------------------------------------
 
@@ -180,6 +240,47 @@ provided the black run is not too tall. Black runs taller than
 
 #----------------------------------------------------------------
 
+class thinning_v_to_skeleton_set(PluginFunction):
+    """The same as `thinning_v_to_skeleton_list`__, but the skeletons
+are returned as a SkeletonSet_ with a single staff, so that no Python
+object is created for the skeleton points.
+
+.. __: musicstaves.html#thinning-v-to-skeleton-list
+"""
+    category = "MusicStaves/Line_tracking"
+    self_type = ImageType([ONEBIT])
+    args = Args([Int("staffline_height")])
+    return_type = Class("skeleton_set")
+
+    def __call__(self, staffline_height):
+        return SkeletonSet(_handle=_line_tracking.thinning_v_to_skeleton_set(\
+                self, staffline_height))
+    __call__ = staticmethod(__call__)
+
+#----------------------------------------------------------------
+
+class create_skeleton_set(PluginFunction):
+    """Creates the C++ part of a SkeletonSet_ from a nested list of
+skeletons. Use the SkeletonSet class instead of calling this directly.
+"""
+    category = None
+    self_type = None
+    args = Args([Class("skeleton_list")])
+    return_type = Class("skeleton_set")
+
+#----------------------------------------------------------------
+
+class skeleton_set_arrays(PluginFunction):
+    """Returns the arrays of a skeleton set created with
+create_skeleton_set_ as strings of native ints.  See SkeletonSet.arrays.
+"""
+    category = None
+    self_type = None
+    args = Args([Class("skeleton_set")])
+    return_type = Class("arrays")
+
+#----------------------------------------------------------------
+
 class skeleton_list_to_image(PluginFunction):
     """Creates an image using a skeleton list as returned by
 get_staff_skeleton_list_.
@@ -187,6 +288,7 @@ get_staff_skeleton_list_.
 Argument:
   *skeleton_list*:
     Nested list of skeleton data. See `get_staff_skeleton_list`__ for details.
+    A SkeletonSet_ is accepted as well.
 
 .. __: musicstaves.html#get-staff-skeleton-list
 
@@ -202,7 +304,8 @@ which the skeletons have been extracted.
     author = "Thomas Karsten"
 
     def __call__(self, list):
-        return _line_tracking.skeleton_list_to_image(self, list)
+        return _line_tracking.skeleton_list_to_image(self,\
+                _skeleton_handle(list))
     __call__ = staticmethod(__call__)
 
 #----------------------------------------------------------------
@@ -272,7 +375,9 @@ vertical black runlength is removed.
 
 The black runlength my contain gaps of *max_gap_height* pixels. Even
 the skeleton pixel is allowed to be white, if the surrounding gap does
-not exceed the maximum gap height."""
+not exceed the maximum gap height.
+
+The skeletons can be given as a nested list or as a SkeletonSet_."""
 
     category = None
     self_type = ImageType(ONEBIT)
@@ -286,7 +391,7 @@ not exceed the maximum gap height."""
     def __call__(self, skel_list, slh, threshold, gap):
 
         return _line_tracking.remove_line_around_skeletons( \
-            self, skel_list, slh, threshold, gap)
+            self, _skeleton_handle(skel_list), slh, threshold, gap)
 
     __call__ = staticmethod(__call__)
 
@@ -301,7 +406,7 @@ copied to the (actual) rescue image).
 
 - *original_image* is the image without the staff lines removed.
 
-- *skeleton*: All skeletons in a nested list.
+- *skeleton*: All skeletons in a nested list or a SkeletonSet_.
 
 - *staffline_height*: (self-explaining)
 
@@ -320,7 +425,7 @@ copied to the (actual) rescue image).
     def __call__(self, orig, skel_list, slh, thr):
 
         _line_tracking.rescue_stafflines_using_mask( \
-            self, orig, skel_list, slh, thr)
+            self, orig, _skeleton_handle(skel_list), slh, thr)
 
     __call__ = staticmethod(__call__)
 
@@ -334,7 +439,7 @@ is \"rescued\" from the staff line removal.
 
 - *original_image* is the image without the staff lines removed.
 
-- *skeleton*: All skeletons in a nested list.
+- *skeleton*: All skeletons in a nested list or a SkeletonSet_.
 
 - *staffline_height*: (self-explaining)
 
@@ -373,7 +478,7 @@ is \"rescued\" from the staff line removal.
         # , dbg, dy, dx):
 
         _line_tracking.rescue_stafflines_using_secondchord( \
-            self, orig, skel_list, slh, \
+            self, orig, _skeleton_handle(skel_list), slh, \
             ssh, thr, gap, pd, direction)
         #, dbg, dy, dx)
 
@@ -414,7 +519,9 @@ class line_tracking_module(PluginModule):
     cpp_headers = ["line_tracking.hpp"]
     functions = [get_staff_skeleton_list, \
                  extract_filled_horizontal_black_runs, \
-                 thinning_v_to_skeleton_list, skeleton_list_to_image, \
+                 thinning_v_to_skeleton_list, thinning_v_to_skeleton_set, \
+                 skeleton_list_to_image, \
+                 create_skeleton_set, skeleton_set_arrays, \
                  follow_staffwobble, remove_line_around_skeletons, \
                  rescue_stafflines_using_mask, \
                  rescue_stafflines_using_secondchord, \
@@ -26,7 +26,7 @@
 from gamera.plugin import *
 import _roach_tatem_plugins
 
-from math import tan
+from math import tan, pi
 
 class compute_vector_field(PluginFunction):
     """Computes the vector field from a onebit image.
@@ -45,15 +45,30 @@ The return value is a FloatImage, where each pixel is the angle (in
 radians) of the line running through the corresponding pixel in the
 given image.  Each pixel value will be in the range (-pi, pi].
 
+*n_threads*
+   The number of threads among which the rows of the image are
+   distributed.  When 0, all available processors are used.  The result
+   does not depend on this value.
+
+*quantized*
+   When ``True``, a GreyScale image with the angles quantized to 8 bits
+   is returned instead, which takes an eighth of the memory.  Its pixels
+   are 128 + *angle* / pi * 127 (rounded), so that the angles are accurate
+   to about 0.7 degrees, and 0 for white pixels.  All functions taking a
+   vector field accept these images.
+
 This function is very computationally intensive.
 """
     self_type = ImageType([ONEBIT])
-    args = Args([Int('window_radius', range=(1,1000), default=0)])
-    return_type = ImageType([FLOAT], "theta")
-    def __call__(self, window_size=0):
+    args = Args([Int('window_radius', range=(1,1000), default=0),
+                 Int('n_threads', range=(0, 256), default=1),
+                 Check('quantized', default=False)])
+    return_type = ImageType([FLOAT, GREYSCALE], "theta")
+    progress_bar = "Computing vector field..."
+    def __call__(self, window_size=0, n_threads=1, quantized=False):
        if window_size == 0:
           window_size = self.most_frequent_run('white', 'vertical') * 3
-       return _roach_tatem_plugins.compute_vector_field(self, window_size)
+       return _roach_tatem_plugins.compute_vector_field(self, window_size, n_threads, quantized)
     __call__ = staticmethod(__call__)
 
 class draw_vector_field(PluginFunction):
@@ -68,7 +83,7 @@ The resulting images can become quite large.  Make sure there is
 adequate memory, or run this function on a small subset of the image.
 """
     pure_python = True
-    self_type = ImageType([FLOAT])
+    self_type = ImageType([FLOAT, GREYSCALE])
     args = Args([Int('cell_size', range=(5, 25), default=10)])
     return_type = ImageType([ONEBIT])
 
@@ -76,11 +91,14 @@ adequate memory, or run this function on a small subset of the image.
         from gamera.core import Image, GREYSCALE, Dim
         result = Image((0, 0), Dim(self.ncols * size, self.nrows * size), GREYSCALE)
         half_size = size / 2
+        quantized = self.data.pixel_type == GREYSCALE
    
         for r in xrange(self.nrows):
             for c in xrange(self.ncols):
                 direction = self.get((c, r))
-                if self.get((c, r)) != 0:
+                if quantized and direction != 0:
+                    direction = (direction - 128) * pi / 127
+                if direction != 0:
                     center_r = r * size + (size / 2)
                     size_c = c * size
                     subimage = result.subimage(Point(r*size, c*size), Dim(size, size))
@@ -95,6 +113,8 @@ images: the first containing pixels believed to be part of stafflines,
 and the second of "questionable pixels", meaning pixels that could be
 either part of stafflines or musical figures.
 
+The vector field may also be quantized (see compute_vector_field_).
+
 When only the original image and a vector field are given, this function is
 part of the Roach and Tatem staff removal algorithm, and implements Section
 3.4 of their paper.
@@ -107,7 +127,7 @@ to 0 it will default to the size of the most frequent black vertical run
 """
     self_type = ImageType([ONEBIT])
     args = Args([
-       ImageType([FLOAT], 'vector_image'), Float('angle_threshold'),
+       ImageType([FLOAT, GREYSCALE], 'vector_image'), Float('angle_threshold'),
        Class('thickness_image'), Int('staffline_height', default=0)])
     return_type = ImageList("lines_questionable")
 
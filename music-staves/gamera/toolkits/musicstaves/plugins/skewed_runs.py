@@ -34,27 +34,58 @@ Arguments:
   and lower vertical direction. When ``up`` or ``down``, the only need to
   run in one direction starting from the given points. Only has effect
   when additionally *poins* is given.
+
+*n_threads*:
+  Number of threads among which the rows are distributed when *points* is
+  empty. When 0, all available processors are used. The result does not
+  depend on this value.
     """
     self_type = ImageType([ONEBIT])
     args = Args([Float('minangle', range=(-85,85)),\
                  Float('maxangle', range=(-85,85)),\
                  Int('height'), PointVector('points'),\
-                 ChoiceString('direction',['both','up','down'])])
+                 ChoiceString('direction',['both','up','down']),\
+                 Int('n_threads', default=1, range=(0, 256))])
     return_type = ImageType([ONEBIT])
     author = "Thomas Karsten and Christoph Dalitz"
 
     # necessary because this is the only way to specify default arguments
-    def __call__(self, minangle, maxangle, height, points=[], direction='both'):
+    def __call__(self, minangle, maxangle, height, points=[], direction='both',
+                 n_threads=1):
         if direction not in ['both','up','down']:
             raise RuntimeError, "Invalid value for 'direction'"
         return _skewed_runs.keep_tall_skewed_runs(\
-            self, minangle, maxangle, height, points, direction)
+            self, minangle, maxangle, height, points, direction, n_threads)
     __call__ = staticmethod(__call__)
 
+class skewed_runs_cache_statistics(PluginFunction):
+    """Returns a dictionary with the statistics of the process wide cache
+in which keep_tall_skewed_runs_ keeps the paths for each combination of
+*minangle*, *maxangle* and *height*:
+
+*hits*, *misses*
+  How many calls found their paths in the cache and how many had to
+  compute them.
+
+*entries*
+  The number of path sets currently in the cache.
+"""
+    self_type = None
+    args = Args([])
+    return_type = Class("statistics")
+
+class skewed_runs_cache_clear(PluginFunction):
+    """Removes all paths from the cache of keep_tall_skewed_runs_. The
+counts of skewed_runs_cache_statistics_ are kept.
+"""
+    self_type = None
+    args = Args([])
+
 class skewed_runs_module(PluginModule):
 	category = "MusicStaves"
 	cpp_headers = ["skewed_runs.hpp"]
-	functions = [keep_tall_skewed_runs]
+	functions = [keep_tall_skewed_runs, skewed_runs_cache_statistics,
+	             skewed_runs_cache_clear]
 	author = "Thomas Karsten"
 
 module = skewed_runs_module()
@@ -33,7 +33,7 @@ scanline. The first value in each list is the *x* position, the subsequent
 entries are the *y* positions of candidate points for staffline anchors.
 """
         self_type = ImageType([ONEBIT])
-        args = Args([Int('scanline_count', range=(4, 100), default=35), \
+        args = Args([Int('scanline_count', range=(4, 1000), default=35), \
                                  Int('tolerance', range=(0,100), default=2), \
                                  Int('staffline_height', range=(0, 100), default=0)])
         return_type = Class("candidate_list")
@@ -47,6 +47,35 @@ entries are the *y* positions of candidate points for staffline anchors.
         __call__ = staticmethod(__call__)
 
 
+class miyao_candidate_points_flat(PluginFunction):
+        """The same as miyao_candidate_points_, but the candidate points
+are returned in a flat list of integers, which is much faster for many
+scanlines. For *n* = *scanline_count*, the list contains
+
+- the *n* *x* positions of the scanlines,
+- *n* + 1 offsets into the list itself: the *y* positions of the
+  candidate points of scanline *k* are the entries at the offsets
+  *list[n+k]* up to (not including) *list[n+k+1]*,
+- the *y* positions of the candidate points of all scanlines.
+
+The scanlines are scanned concurrently by *n_threads* threads
+(0 means as many as there are processors).
+"""
+        self_type = ImageType([ONEBIT])
+        args = Args([Int('scanline_count', range=(4, 1000), default=35), \
+                                 Int('tolerance', range=(0,100), default=2), \
+                                 Int('staffline_height', range=(0, 100), default=0), \
+                                 Int('n_threads', range=(0, 256), default=1)])
+        return_type = IntVector("candidates")
+
+        def __call__(self, scanline_count=35, tolerance=2, staffline_height=0, n_threads=1):
+                if staffline_height == 0:
+                        staffline_height = self.most_frequent_run('black', 'vertical')
+                return _staff_finding_miyao.miyao_candidate_points_flat(self, scanline_count, tolerance, staffline_height, n_threads)
+
+        __call__ = staticmethod(__call__)
+
+
 class miyao_distance(PluginFunction):
         """Returns 0 when two points *a* and *b* ly on the same staff line
 candidate and *penalty* if not (note that Miyao uses 2 for a mismatch instead).
@@ -73,6 +102,29 @@ The distance zero is only returned when the following two conditions hold:
         __call__ = staticmethod(__call__)
 
 
+class miyao_match_anchors(PluginFunction):
+        """Connects the staff line anchor points *ys1* on column *col1*
+with the anchor points *ys2* on column *col2* by Miyao's DP matching.
+This is the same as computing the minimum edit distance matrix from
+miyao_distance_ for all pairs of anchor points and backtracing it, but
+all is done in one call.
+
+Returns the matched pairs as a flat list [i0, j0, i1, j1, ...] of
+indices into *ys1* and *ys2*, starting with the last anchor points.
+"""
+        self_type = ImageType([ONEBIT])
+        args = Args([Int('col1'), IntVector('ys1'), Int('col2'), IntVector('ys2'),\
+                                 Float('blackness', range=(0,1), default=0.8),\
+                                 Float('pr_angle', range=(-pi/2,pi/2), default=pi),\
+                                 Int('penalty', default=3)])
+        return_type = IntVector("links")
+
+        # only for default argument
+        def __call__(self, col1, ys1, col2, ys2, blackness=0.8, pr_angle=pi, penalty=3):
+            return _staff_finding_miyao.miyao_match_anchors(self, col1, ys1, col2, ys2, blackness, pr_angle, penalty)
+        __call__ = staticmethod(__call__)
+
+
 class miyao_find_edge(PluginFunction):
         """Looks for a staff line edge point near (*x*,*y*).
 
@@ -90,6 +142,21 @@ Returns the new edge point as a vector [x,y]
         return_type = IntVector("edgepoint", length=2)
         author = "Christoph Dalitz"
 
+class miyao_find_edges(PluginFunction):
+        """Looks for the staff line edge points near many points at once.
+
+This is the same as calling miyao_find_edge_ with the point
+(*xs[i]*, *ys[i]*), angle *angles[i]* and direction *leftdirections[i]*
+(nonzero means left) for each i, but all points are traced in one call,
+which is much faster when there are many points.
+
+Returns the edge points as a flat list [x0, y0, x1, y1, ...].
+"""
+        self_type = ImageType([ONEBIT])
+        args = Args([IntVector('xs'), IntVector('ys'), FloatVector('angles'),\
+                     IntVector('leftdirections')])
+        return_type = IntVector("edgepoints")
+
 class StaffFinder_miyao(PluginFunction):
     """Creates a StaffFinder_miyao__ object.
 
@@ -117,8 +184,9 @@ they are computed automatically.
 class staff_finding_miyao_module(PluginModule):
         category = "MusicStaves/Miyao"
         cpp_headers = ["staff_finding_miyao.hpp"]
-        functions = [miyao_candidate_points, miyao_distance, miyao_find_edge,
-                     StaffFinder_miyao]
+        functions = [miyao_candidate_points, miyao_candidate_points_flat,
+                     miyao_distance, miyao_match_anchors,
+                     miyao_find_edge, miyao_find_edges, StaffFinder_miyao]
         author = "Christoph Dalitz, Florian Pose (after an algorithm by H. Miyao)"
 
 module = staff_finding_miyao_module()
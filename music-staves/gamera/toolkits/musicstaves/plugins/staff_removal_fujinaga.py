@@ -22,6 +22,53 @@ import _staff_removal_fujinaga
 
 crossing_symbols_choices = ['all', 'bar', 'none']
 
+class FujinagaWorkspace:
+    """Keeps the page sized temporary buffers of the Fujinaga staff
+removal between calls.  When many pages of the same size are
+processed, passing the same workspace to each call of
+find_and_remove_staves_fujinaga_ or remove_staves_fujinaga_ avoids
+allocating these buffers again for every page:
+
+.. code:: Python
+
+   workspace = FujinagaWorkspace()
+   for image in images:
+       result = image.find_and_remove_staves_fujinaga(workspace=workspace)
+   print workspace.statistics()["peak_bytes"]
+
+The returned images are not part of the workspace.  A workspace must
+not be used by two threads at the same time.
+"""
+    def __init__(self):
+        self.workspace = _staff_removal_fujinaga.create_fujinaga_workspace()
+
+    def statistics(self):
+        """Returns a dictionary with the memory use of the workspace:
+
+*allocated_bytes*
+   The size of all buffers currently held by the workspace.
+
+*peak_bytes*
+   The maximum of *allocated_bytes* so far.
+
+*in_use_bytes*
+   The part of *allocated_bytes* that is in use by a running call.
+
+*allocations*, *reuses*
+   How many buffers have been newly allocated and how many have been
+   reused from previous calls.
+"""
+        return _staff_removal_fujinaga.fujinaga_workspace_statistics(self.workspace)
+
+    def clear(self):
+        """Frees all buffers held by the workspace."""
+        _staff_removal_fujinaga.fujinaga_workspace_clear(self.workspace)
+
+def _workspace_handle(workspace):
+    if workspace is None:
+        return None
+    return workspace.workspace
+
 class find_and_remove_staves_fujinaga(PluginFunction):
     """Locates staves while deskewing the image, and then removes the
 staves.  Returns a tuple of the form (*deskewed_image*,
@@ -34,8 +81,10 @@ where the stafflines are.
    Not yet implemented -- just a placeholder for now.
 
 *n_stafflines* = 5
-   The number of stafflines in each staff.  (Autodetection of number
-   of stafflines not yet implemented).
+   The number of stafflines in each staff.  When 0, the number of
+   stafflines is detected for each staff separately, so that pages
+   with staves of different numbers of lines (e.g. one line
+   percussion staves) are handled.
 
 *staffline_height* = 0
    The height (in pixels) of the stafflines. If *staffline_height* <=
@@ -67,25 +116,42 @@ where the stafflines are.
 *find_only* = ``False``
    When ``True``, only perform staffline detection.  Do not deskew the
    image or remove the stafflines.
+
+*undo_deskew* = ``False``
+   When ``True``, the deskewing is undone on the returned images, so
+   that they are aligned with the input image.
+
+*n_threads* = 1
+   The number of threads used for the skew estimation and for
+   removing the stafflines (the staves are processed concurrently).
+   When 0, all available processors are used.  The result does not depend on this
+   value.  Has no effect when the toolkit has been compiled without
+   OpenMP support.
+
+*workspace* = ``None``
+   A FujinagaWorkspace_ in which the temporary buffers are kept for
+   the next call.
 """
     category = "MusicStaves/Fujinaga"
     self_type = ImageType([ONEBIT])
     args = Args([
        Choice('crossing_symbols', crossing_symbols_choices),
-       Int('n_stafflines', (3, 12), default=5),
+       Int('n_stafflines', (0, 12), default=5),
        Float('staffline_height', (0.0, 512.0), default=0.0),
        Float('staffspace_height', (0.0, 512.0), default=0.0),
        Int('skew_strip_width', (0, 512), default=0),
        Float('max_skew', (1, 20), default=8.0),
        Check('deskew_only', default=False),
        Check('find_only', default=False),
-       Check('undo_deskew', default=False)
+       Check('undo_deskew', default=False),
+       Int('n_threads', (0, 256), default=1),
+       Class('workspace')
        ])
     return_type = Class("result")
     def __call__(self, crossing_symbols=0, n_stafflines=5, 
                  staffline_height=0.0, staffspace_height=0.0, skew_strip_width=0,
                  max_skew=8.0, deskew_only=False, find_only=False,
-                 undo_deskew=False):
+                 undo_deskew=False, n_threads=1, workspace=None):
        if type(crossing_symbols) == str:
            if crossing_symbols in crossing_symbols_choices:
                crossing_symbols = crossing_symbols_choices.index(crossing_symbols)
@@ -93,7 +159,130 @@ where the stafflines are.
                raise ValueError("crossing symbols must be one of %s" % repr(crossing_symbols))
        return _staff_removal_fujinaga.find_and_remove_staves_fujinaga(
           self, crossing_symbols, n_stafflines, staffline_height, staffspace_height,
-          skew_strip_width, max_skew, deskew_only, find_only, undo_deskew)
+          skew_strip_width, max_skew, deskew_only, find_only, undo_deskew,
+          n_threads, _workspace_handle(workspace))
+    __call__ = staticmethod(__call__)
+
+class find_and_remove_staves_fujinaga_bands(PluginFunction):
+    """Like find_and_remove_staves_fujinaga_ with *undo_deskew* =
+``True``, but processes the image in overlapping horizontal bands, so
+that the memory needed for the temporary images is bounded by the band
+height rather than by the page height.  This is intended for very tall
+images like high resolution facsimiles or scrolls.
+
+Returns an iterator that yields tuples (*y*, *removed_band*, *staves*)
+from top to bottom as soon as each band is finished.  *removed_band*
+are the rows of the image starting at row *y* with the staves removed;
+together the bands cover the whole image without overlap.  *staves* is
+the list of ``StaffObj`` instances found in these rows, in page
+coordinates.
+
+Each band is deskewed on its own, so the result may differ slightly
+from find_and_remove_staves_fujinaga on the entire page.
+
+*band_height* = 0
+   The height of the bands in pixels (including the overlap).  When
+   0, bands of about ten staff heights are used.
+
+*overlap* = 0
+   The number of rows shared by neighbouring bands.  Must hold at
+   least two staves including their margins, so that every staff
+   lies entirely within the band it is reported from.  When 0, it is
+   computed from the staff height.
+
+The other arguments are the same as for
+find_and_remove_staves_fujinaga_.  When *staffline_height* or
+*staffspace_height* are not given, they are determined once from the
+whole image, so that all bands use the same values.
+
+.. code:: Python
+
+   for y, band, staves in image.find_and_remove_staves_fujinaga_bands():
+       band.save_PNG("removed_%06d.png" % y)
+"""
+    category = "MusicStaves/Fujinaga"
+    self_type = ImageType([ONEBIT])
+    args = Args([
+       Choice('crossing_symbols', crossing_symbols_choices),
+       Int('n_stafflines', (0, 12), default=5),
+       Float('staffline_height', (0.0, 512.0), default=0.0),
+       Float('staffspace_height', (0.0, 512.0), default=0.0),
+       Int('band_height', default=0),
+       Int('overlap', default=0),
+       Int('skew_strip_width', (0, 512), default=0),
+       Float('max_skew', (1, 20), default=8.0),
+       Int('n_threads', (0, 256), default=1),
+       Class('workspace')
+       ])
+    return_type = Class("bands")
+    pure_python = True
+    def __call__(self, crossing_symbols=0, n_stafflines=5,
+                 staffline_height=0.0, staffspace_height=0.0, band_height=0,
+                 overlap=0, skew_strip_width=0, max_skew=8.0, n_threads=1,
+                 workspace=None):
+        from gamera.core import Point as CorePoint, Rect as CoreRect
+        if type(crossing_symbols) == str:
+            crossing_symbols = crossing_symbols_choices.index(crossing_symbols)
+        if staffline_height <= 0:
+            staffline_height = self.most_frequent_run('black', 'vertical')
+        if staffspace_height <= 0:
+            staffspace_height = self.most_frequent_run('white', 'vertical')
+        # with autodetection, the bands are made large enough for staves
+        # of up to six lines
+        staff_height = int((max(n_stafflines, 6) - 1) * (staffline_height + staffspace_height)
+                           + staffline_height)
+        if overlap <= 0:
+            # two staves with their margins (see find_stafflines)
+            overlap = 2 * (staff_height + int(4 * staffline_height + 2 * staffspace_height))
+        if band_height <= 0:
+            band_height = 5 * overlap
+        if band_height <= overlap:
+            raise ValueError("band_height must be larger than overlap")
+
+        # the staves of a band are relative to the band (see the
+        # offsets removed in find_and_remove_staves_fujinaga)
+        def translate(staff, x, y):
+            staff.yposlist = [pos + y for pos in staff.yposlist]
+            r = staff.staffrect
+            staff.staffrect = CoreRect(CorePoint(r.ul_x + x, r.ul_y + y),
+                                       CorePoint(r.lr_x + x, r.lr_y + y))
+
+        staff_no = 0
+        top = 0
+        while top < self.nrows:
+            bottom = min(top + band_height, self.nrows)
+            # the rows [own_top, own_bottom) of the band are reported
+            if top == 0:
+                own_top = 0
+            else:
+                own_top = top + overlap / 2
+            if bottom == self.nrows:
+                own_bottom = bottom
+            else:
+                own_bottom = bottom - overlap / 2
+            band = self.subimage(CorePoint(self.ul_x, self.ul_y + top),
+                                 CorePoint(self.lr_x, self.ul_y + bottom - 1))
+            deskewed, removed, staves = \
+                _staff_removal_fujinaga.find_and_remove_staves_fujinaga(
+                band, crossing_symbols, n_stafflines, staffline_height,
+                staffspace_height, skew_strip_width, max_skew, False, False,
+                True, n_threads, _workspace_handle(workspace))
+            del deskewed, band
+            own_staves = []
+            for staff in staves:
+                middle = (staff.staffrect.ul_y + staff.staffrect.lr_y) / 2 + top
+                if own_top <= middle < own_bottom:
+                    translate(staff, self.ul_x, self.ul_y + top)
+                    staff.staffno = staff_no
+                    staff_no += 1
+                    own_staves.append(staff)
+            removed_band = removed.subimage(
+                CorePoint(removed.ul_x, removed.ul_y + own_top - top),
+                CorePoint(removed.lr_x, removed.ul_y + own_bottom - top - 1))
+            yield (self.ul_y + own_top, removed_band, own_staves)
+            if bottom == self.nrows:
+                break
+            top += band_height - overlap
     __call__ = staticmethod(__call__)
 
 class find_and_deskew_staves_fujinaga(PluginFunction):
@@ -102,8 +291,10 @@ the form (*image*, *staves*) where *image* is the image deskewed, and
 *staves* is a list of ``StaffObj``.
 
 *n_stafflines* = 5
-   The number of stafflines in each staff.  (Autodetection of number
-   of stafflines not yet implemented).
+   The number of stafflines in each staff.  When 0, the number of
+   stafflines is detected for each staff separately, so that pages
+   with staves of different numbers of lines (e.g. one line
+   percussion staves) are handled.
 
 *staffline_height* = 0
    The height (in pixels) of the stafflines. If *staffline_height* <=
@@ -131,7 +322,7 @@ the form (*image*, *staves*) where *image* is the image deskewed, and
     category = "MusicStaves/Fujinaga"
     self_type = ImageType([ONEBIT])
     args = Args([
-       Int('n_stafflines', (3, 12), default=5),
+       Int('n_stafflines', (0, 12), default=5),
        Float('staffline_height', default=0.0),
        Float('staffspace_height', default=0.0),
        Int('skew_strip_width', (1, 64), default=0),
@@ -143,7 +334,7 @@ the form (*image*, *staves*) where *image* is the image deskewed, and
                  skew_strip_width=0, max_skew=8.0):
         return _staff_removal_fujinaga.find_and_remove_staves_fujinaga(
             self, 0, n_stafflines, staffline_height, staffspace_height,
-            skew_strip_width, max_skew, True, False)
+            skew_strip_width, max_skew, True, False, False, 1, None)
     __call__ = staticmethod(__call__)
 
 class find_staves_fujinaga(PluginFunction):
@@ -153,8 +344,10 @@ whether an image has stafflines or not.  Returns a list of
 ``StaffObj``.
 
 *n_stafflines* = 5
-   The number of stafflines in each staff.  (Autodetection of number
-   of stafflines not yet implemented).
+   The number of stafflines in each staff.  When 0, the number of
+   stafflines is detected for each staff separately, so that pages
+   with staves of different numbers of lines (e.g. one line
+   percussion staves) are handled.
 
 *staffline_height* = 0
    The height (in pixels) of the stafflines. If *staffline_height* <=
@@ -182,7 +375,7 @@ whether an image has stafflines or not.  Returns a list of
     category = "MusicStaves/Fujinaga"
     self_type = ImageType([ONEBIT])
     args = Args([
-       Int('n_stafflines', (3, 12), default=5),
+       Int('n_stafflines', (0, 12), default=5),
        Float('staffline_height', default=0.0),
        Float('staffspace_height', default=0.0),
        Int('skew_strip_width', (1, 64), default=0),
@@ -194,7 +387,7 @@ whether an image has stafflines or not.  Returns a list of
                  skew_strip_width=0, max_skew=8.0):
         return _staff_removal_fujinaga.find_and_remove_staves_fujinaga(
             self, 0, n_stafflines, staffline_height, staffspace_height,
-            skew_strip_width, max_skew, True, True)
+            skew_strip_width, max_skew, True, True, False, 1, None)
     __call__ = staticmethod(__call__)
 
 class global_staffline_deskew(PluginFunction):
@@ -232,6 +425,12 @@ anything ultimately useful.
    vertical strip.  Expressed in degrees.  This value should be fairly
    small, because deskewing only approximates rotation at very small
    degrees.
+
+*rle* = ``False``
+   When ``True``, the deskewing works on the vertical runs of the
+   image instead of on its pixels, and the returned image is run-length
+   encoded (RLE).  The result is the same, but this needs much less
+   memory and time for mostly white pages.
 """
     category = "MusicStaves/Fujinaga"
     self_type = ImageType([ONEBIT])
@@ -239,13 +438,14 @@ anything ultimately useful.
         Float('staffline_height', default=0.0),
         Float('staffspace_height', default=0.0),
         Int('skew_strip_width', default=0),
-        Float('max_skew', default=5.0)])
+        Float('max_skew', default=5.0),
+        Check('rle', default=False)])
     return_type = ImageType([ONEBIT])
     def __call__(self, staffline_height=0.0, staffspace_height=0.0,
-                 skew_strip_width=0, max_skew=8.0):
-        return _staff_removal_fujinaga.global_staffline_deskewing(
+                 skew_strip_width=0, max_skew=8.0, rle=False):
+        return _staff_removal_fujinaga.global_staffline_deskew(
             self, staffline_height, staffspace_height,
-            skew_strip_width, max_skew)
+            skew_strip_width, max_skew, rle)
     __call__ = staticmethod(__call__)
 
 class remove_staves_fujinaga(PluginFunction):
@@ -274,6 +474,10 @@ Returns the image with the staves removed.
    *staffspace_height* <= 0, the staffspace height is autodetected
    both globally and for each staff.
 
+*workspace* = ``None``
+   A FujinagaWorkspace_ in which the temporary buffers are kept for
+   the next call.
+
 Note that the following are essentially (*) equivalent, (though the
 first is slightly faster):
 
@@ -295,18 +499,47 @@ result.
         [Class('staves'),
          Choice('crossing_symbols', ['all', 'bars', 'none']),
          Float('staffline_height', default=0.0),
-         Float('staffspace_height', default=0.0)])
+         Float('staffspace_height', default=0.0),
+         Class('workspace')])
     return_type = ImageType([ONEBIT])
-    def __call__(self, staves, crossing_symbols=0, staffline_height=0.0, staffspace_height=0.0):
+    def __call__(self, staves, crossing_symbols=0, staffline_height=0.0, staffspace_height=0.0,
+                 workspace=None):
         if type(crossing_symbols) == str:
             if crossing_symbols in crossing_symbols_choices:
                 crossing_symbols = crossing_symbols_choices.index(crossing_symbols)
             else:
                 raise ValueError("crossing symbols must be one of %s" % repr(crossing_symbols))
         return _staff_removal_fujinaga.remove_staves_fujinaga(
-            self, staves, crossing_symbols, staffline_height, staffspace_height)
+            self, staves, crossing_symbols, staffline_height, staffspace_height,
+            _workspace_handle(workspace))
     __call__ = staticmethod(__call__)
 
+class create_fujinaga_workspace(PluginFunction):
+    """Creates the C++ part of a FujinagaWorkspace_.  Use the
+FujinagaWorkspace class instead of calling this directly.
+"""
+    category = "MusicStaves/Fujinaga"
+    self_type = None
+    args = Args([])
+    return_type = Class("workspace")
+
+class fujinaga_workspace_statistics(PluginFunction):
+    """Returns the memory statistics of a workspace created with
+create_fujinaga_workspace_.  See FujinagaWorkspace.statistics.
+"""
+    category = "MusicStaves/Fujinaga"
+    self_type = None
+    args = Args([Class('workspace')])
+    return_type = Class("statistics")
+
+class fujinaga_workspace_clear(PluginFunction):
+    """Frees all buffers of a workspace created with
+create_fujinaga_workspace_.  See FujinagaWorkspace.clear.
+"""
+    category = "MusicStaves/Fujinaga"
+    self_type = None
+    args = Args([Class('workspace')])
+
 class MusicStaves_rl_fujinaga(PluginFunction):
     """Returns a new MusicStaves_fl_fujinaga__ object from the image.
 
@@ -329,15 +562,19 @@ class StaffRemovalFujinaga(PluginModule):
     cpp_headers = ["staff_removal_fujinaga.hpp", "staff_removal_fujinaga_python.hpp"]
     category = "MusicStaves"
     # extra_libraries = ['tiff']
-    functions = [find_and_remove_staves_fujinaga, global_staffline_deskew,
+    functions = [find_and_remove_staves_fujinaga,
+                 find_and_remove_staves_fujinaga_bands, global_staffline_deskew,
                  find_and_deskew_staves_fujinaga, find_staves_fujinaga,
-                 remove_staves_fujinaga, MusicStaves_rl_fujinaga]
+                 remove_staves_fujinaga, MusicStaves_rl_fujinaga,
+                 create_fujinaga_workspace, fujinaga_workspace_statistics,
+                 fujinaga_workspace_clear]
                  # remove_staves_fujinaga2]
     author = "Michael Droettboom, Karl MacMillan and Ichiro Fujinaga"
 
 module = StaffRemovalFujinaga()
 
 find_and_remove_staves_fujinaga = find_and_remove_staves_fujinaga()
+find_and_remove_staves_fujinaga_bands = find_and_remove_staves_fujinaga_bands()
 global_staffline_deskew = global_staffline_deskew()
 find_staves_fujinaga = find_staves_fujinaga()
 find_and_deskew_staves_fujinaga = find_and_deskew_staves_fujinaga()
@@ -55,22 +55,37 @@ Arguments:
 *resolution*:
    Angle that is used to scan the image (in degree). When the resolution is
    set to 0, then the default value will be used instead.
+
+*n_threads*:
+   Number of threads among which the rows (with *directional_runs* the
+   angles) are distributed. When 0, all available processors are used.
+   The result does not depend on this value.
+
+*directional_runs*:
+   When set, the chords are measured along digital lines, for which the
+   chord lengths of all pixels are computed in two passes over the black
+   pixels per angle (directional run length transforms). This is much
+   faster for large *path_length*, but the results can differ in single
+   pixels from the default tracing of each chord.
 """
     self_type = ImageType([ONEBIT])
     args = Args([Int('path_length', default=0),\
-		    Float('resolution', default=3.0, range=(0.0, 90.0))])
+		    Float('resolution', default=3.0, range=(0.0, 90.0)),\
+		    Int('n_threads', default=1, range=(0, 256)),\
+		    Check('directional_runs', default=False)])
     return_type = ImageList("vectors")
     category = "MusicStaves/vector_field"
     author = "Thomas Karsten"
 
-    def __call__(self, path_length=0, resolution=3.0):
+    def __call__(self, path_length=0, resolution=3.0, n_threads=1,
+                 directional_runs=False):
         if path_length == 0:
             path_length = self.most_frequent_run('white',\
                     'vertical') * 5
         if not resolution > 0.0:
             resolution=3.0
         return _vector_field.compute_longest_chord_vectors(self,\
-                path_length, resolution)
+                path_length, resolution, n_threads, directional_runs)
 
     __call__ = staticmethod(__call__)
 
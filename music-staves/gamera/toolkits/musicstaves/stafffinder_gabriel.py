@@ -99,49 +99,6 @@ somewhat more detailed.
                 maxind = i
         return maxind
 
-    ######################################################################
-    # computes Miyao's minimum distance matrix
-    #  Input:
-    #    cp1/2 - two candidate point lists as returned by get_candidate_points
-    #  Output:
-    #    the distance matrix g
-    #
-    def __compute_matrix(self, cp1, cp2, blackness, prev_angle):
-
-        class matrix_point:
-            def __init__(self):
-                self.value = -1
-                self.distance = -1  # distance to g[i-1,j-1]
-
-        col1 = cp1.x; col2 = cp2.x
-        I = len(cp1.anchorlist)+1; J = len(cp2.anchorlist)+1
-
-        # initalize matrix
-        g = [[matrix_point() for j in range(J)] for i in range(I)]
-        g[0][0].value = 0
-        for i in range(I-1):
-            g[i+1][0].value = i+1
-        for j in range(J-1):
-            g[0][j+1].value = j+1
-
-        # fill matrix successively
-        for i in range(1,I):
-            for j in range(1,J):
-                try:
-                    distance = self.image.miyao_distance(col1, cp1.anchorlist[i-1].y,\
-                                               col2, cp2.anchorlist[j-1].y,\
-                                               blackness=blackness,\
-                                               pr_angle=prev_angle)
-                except:
-                    print "Error with anchorpoints", col1, cp1.anchorlist[i-1].y, col2, cp2.anchorlist[j-1].y
-                    raise RuntimeError, "Error"
-                g[i][j].value = min([ g[i-1][j-1].value + distance,\
-                                     g[i-1][j].value + 1, g[i][j-1].value + 1 ])
-                g[i][j].distance = distance
-        return g
-
-
-
     ######################################################################
     # find_staves
     #
@@ -257,30 +214,22 @@ with
 
         for n in range(len(cplist)-1):
             cp1 = cplist[n]; cp2 = cplist[n+1]
-            g = self.__compute_matrix(cp1, cp2, blackness, prev_angle)
-            I = len(cp1.anchorlist)+1; J = len(cp2.anchorlist)+1
             sumangle = 0
             nangle = 0
 
-            # backtrace matches
+            # DP matching (distance matrix and backtracing in C++)
             col1 = cp1.x; col2 = cp2.x
-            i = I - 1; j = J - 1
-            while (i>0) and (j>0):
-                if g[i][j].value - g[i][j].distance == g[i-1][j-1].value:
-                    # link found
-                    left = cp1.anchorlist[i-1]
-                    right = cp2.anchorlist[j-1]
-                    left.right.append(right); right.left.append(left)
-                    sumangle += atan2(float(right.y - left.y), float(col2-col1))
-                    nangle += 1
-                    i = i - 1
-                    j = j - 1
-                elif g[i][j].value - 1 == g[i-1][j].value:
-                    i = i-1
-                elif g[i][j].value - 1 == g[i][j-1].value:
-                    j = j-1
-                else:
-                    raise RuntimeError, "Error in backtracing distance matrix"
+            links = self.image.miyao_match_anchors(\
+                col1, [ap.y for ap in cp1.anchorlist],\
+                col2, [ap.y for ap in cp2.anchorlist],\
+                blackness=blackness, pr_angle=prev_angle)
+            for k in range(0, len(links), 2):
+                # link found
+                left = cp1.anchorlist[links[k]]
+                right = cp2.anchorlist[links[k+1]]
+                left.right.append(right); right.left.append(left)
+                sumangle += atan2(float(right.y - left.y), float(col2-col1))
+                nangle += 1
 
             # store angle info
             if nangle > 0:
@@ -602,6 +551,29 @@ with
                  # might be most right point in line
                  allpoints[ap.staff][ap.line].rightangle = line.avgangle
 
+        # extrapolate edge points (all lines in one call per side)
+        linepoints = [lp for staff in allpoints.values() for lp in staff.values()]
+        edges = self.image.miyao_find_edges(\
+            [lp.points[0][0] for lp in linepoints],\
+            [lp.points[0][1] for lp in linepoints],\
+            [lp.leftangle for lp in linepoints], [1] * len(linepoints))
+        for i, lp in enumerate(linepoints):
+           [x,y] = edges[2*i:2*i+2]
+           if x < lp.points[0][0]:
+              lp.points.insert(0,[x,y])
+           else:
+              lp.points[0] = [x,y]
+        edges = self.image.miyao_find_edges(\
+            [lp.points[-1][0] for lp in linepoints],\
+            [lp.points[-1][1] for lp in linepoints],\
+            [lp.rightangle for lp in linepoints], [0] * len(linepoints))
+        for i, lp in enumerate(linepoints):
+           [x,y] = edges[2*i:2*i+2]
+           if x > lp.points[-1][0]:
+              lp.points.append([x,y])
+           else:
+              lp.points[-1] = [x,y]
+
         # adjust left edge
         for staff in allpoints.values():
 
@@ -612,23 +584,6 @@ with
                        staff[max(staff.keys())].points[0][1],\
                        len(staff.keys())))
         
-           # extrapolate edge points
-           for lp in staff.values():
-              leftpoint = lp.points[0]
-              [x,y] = self.image.miyao_find_edge(leftpoint[0], leftpoint[1],\
-                                            lp.leftangle, True)
-              if x < leftpoint[0]:
-                 lp.points.insert(0,[x,y])
-              else:
-                 lp.points[0] = [x,y]
-              rightpoint = lp.points[-1]
-              [x,y] = self.image.miyao_find_edge(rightpoint[0], rightpoint[1],\
-                                            lp.rightangle, False)
-              if x > rightpoint[0]:
-                 lp.points.append([x,y])
-              else:
-                 lp.points[-1] = [x,y]
-
            # compute average staff angle
            staffangle = 0.0
            nlinks = 0
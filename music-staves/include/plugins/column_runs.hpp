@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2026 MusicStaves Toolkit contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * column_runs.hpp
+ *
+ * A run-length representation of onebit images by vertical black runs.
+ *
+ * Scanned music pages are mostly white, so that the runs take only a
+ * fraction of the memory of a dense image, and everything that only
+ * depends on the vertical runs (run histograms, y-projections of strips,
+ * filtering of tall runs, shearing of columns) is much cheaper on the
+ * runs than on the pixels.
+ */
+
+#ifndef MUSICSTAVES_COLUMN_RUNS_2026
+#define MUSICSTAVES_COLUMN_RUNS_2026
+
+#include <stdlib.h> // for abs
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <gamera.hpp>
+#include "musicstaves_parallel.hpp"
+
+namespace Aomr {
+
+  // The vertical black runs of a onebit image, column by column.
+  // A run covers the rows [start, end) and the runs of each column are
+  // sorted and separated by at least one white pixel.
+  class ColumnRuns {
+  public:
+    struct Run {
+      Run(int start_, int end_) : start(start_), end(end_) {}
+      int start, end;
+    };
+    typedef std::vector<Run> RunList;
+
+    // Collects the runs of *image* (of any onebit storage type) in a single
+    // pass over its rows.
+    template<class T>
+    explicit ColumnRuns(T& image) : m_nrows(image.nrows()), m_columns(image.ncols()) {
+      size_t ncols = image.ncols();
+      std::vector<int> start(ncols, -1);
+      typename T::row_iterator row = image.row_begin();
+      for (size_t r = 0; r < m_nrows; ++r, ++row) {
+	typename T::row_iterator::iterator col = row.begin();
+	for (size_t c = 0; c < ncols; ++c, ++col) {
+	  if (is_black(*col)) {
+	    if (start[c] < 0)
+	      start[c] = int(r);
+	  } else if (start[c] >= 0) {
+	    m_columns[c].push_back(Run(start[c], int(r)));
+	    start[c] = -1;
+	  }
+	}
+      }
+      for (size_t c = 0; c < ncols; ++c)
+	if (start[c] >= 0)
+	  m_columns[c].push_back(Run(start[c], int(m_nrows)));
+    }
+
+    // Copies of non-const objects would otherwise use the template above
+    ColumnRuns(ColumnRuns& other) : m_nrows(other.m_nrows), m_columns(other.m_columns) {}
+
+    size_t nrows() const { return m_nrows; }
+    size_t ncols() const { return m_columns.size(); }
+    const RunList& column(size_t col) const { return m_columns[col]; }
+
+    size_t n_runs() const {
+      size_t n = 0;
+      for (size_t c = 0; c < m_columns.size(); ++c)
+	n += m_columns[c].size();
+      return n;
+    }
+
+    // The histograms of the vertical black and white run lengths, as
+    // returned by Gamera's run_histogram (both have nrows() + 1 entries).
+    void run_histograms(IntVector& black_hist, IntVector& white_hist) const {
+      black_hist.assign(m_nrows + 1, 0);
+      white_hist.assign(m_nrows + 1, 0);
+      for (size_t c = 0; c < m_columns.size(); ++c) {
+	const RunList& runs = m_columns[c];
+	int white_start = 0;
+	for (RunList::const_iterator i = runs.begin(); i != runs.end(); ++i) {
+	  ++black_hist[i->end - i->start];
+	  if (i->start > white_start)
+	    ++white_hist[i->start - white_start];
+	  white_start = i->end;
+	}
+	if (int(m_nrows) > white_start)
+	  ++white_hist[m_nrows - white_start];
+      }
+    }
+
+    // The same as most_frequent_run(image, runs::Black/White(), runs::Vertical())
+    void most_frequent_runs(int& black_run, int& white_run) const {
+      IntVector black_hist, white_hist;
+      run_histograms(black_hist, white_hist);
+      black_run = int(std::max_element(black_hist.begin(), black_hist.end()) - black_hist.begin());
+      white_run = int(std::max_element(white_hist.begin(), white_hist.end()) - white_hist.begin());
+    }
+
+    // Removes all runs longer than *max_length* (like filter_tall_runs)
+    void filter_tall_runs(size_t max_length) {
+      for (size_t c = 0; c < m_columns.size(); ++c) {
+	RunList& runs = m_columns[c];
+	RunList::iterator out = runs.begin();
+	for (RunList::iterator i = runs.begin(); i != runs.end(); ++i)
+	  if (size_t(i->end - i->start) <= max_length)
+	    *(out++) = *i;
+	runs.erase(out, runs.end());
+      }
+    }
+
+    // Removes all 8-connected black components with fewer than *min_pixels*
+    // pixels (like despeckle) or that are narrower than *min_width* (like
+    // ccs::filter_narrow on the result of cc_analysis).  The components are
+    // labeled with a union-find over the runs of neighbouring columns.
+    void remove_components(size_t min_pixels, int min_width) {
+      size_t ncols = m_columns.size();
+      std::vector<size_t> first(ncols + 1, 0);
+      for (size_t c = 0; c < ncols; ++c)
+	first[c + 1] = first[c] + m_columns[c].size();
+      size_t n = first[ncols];
+
+      std::vector<size_t> parent(n);
+      for (size_t i = 0; i < n; ++i)
+	parent[i] = i;
+      for (size_t c = 0; c + 1 < ncols; ++c) {
+	const RunList& left = m_columns[c];
+	const RunList& right = m_columns[c + 1];
+	size_t i = 0, j = 0;
+	while (i < left.size() && j < right.size()) {
+	  // the runs touch (8-connected) if their rows are at most one apart
+	  if (left[i].start <= right[j].end && right[j].start <= left[i].end) {
+	    size_t a = find(parent, first[c] + i), b = find(parent, first[c + 1] + j);
+	    if (a != b)
+	      parent[std::max(a, b)] = std::min(a, b);
+	  }
+	  if (left[i].end < right[j].end)
+	    ++i;
+	  else
+	    ++j;
+	}
+      }
+
+      // the roots are the first runs of their components, so that the
+      // columns are visited from left to right
+      std::vector<size_t> pixels(n, 0);
+      std::vector<int> min_x(n, 0), max_x(n, 0);
+      for (size_t c = 0; c < ncols; ++c)
+	for (size_t i = 0; i < m_columns[c].size(); ++i) {
+	  size_t root = find(parent, first[c] + i);
+	  if (root == first[c] + i)
+	    min_x[root] = int(c);
+	  max_x[root] = int(c);
+	  pixels[root] += m_columns[c][i].end - m_columns[c][i].start;
+	}
+
+      for (size_t c = 0; c < ncols; ++c) {
+	RunList& runs = m_columns[c];
+	RunList::iterator out = runs.begin();
+	for (size_t i = 0; i < runs.size(); ++i) {
+	  size_t root = find(parent, first[c] + i);
+	  if (pixels[root] >= min_pixels && max_x[root] - min_x[root] + 1 >= min_width)
+	    *(out++) = runs[i];
+	}
+	runs.erase(out, runs.end());
+      }
+    }
+
+    // Shears column *col* by *distance* with the semantics of shear_column:
+    // the pixels moved in at the border are copies of the border pixel.
+    void shear_column(size_t col, int distance) {
+      if (distance == 0)
+	return;
+      if (size_t(std::abs(distance)) >= m_nrows)
+	throw std::range_error("Tried to shear column too far");
+      RunList& runs = m_columns[col];
+      int n = int(m_nrows);
+      RunList::iterator out = runs.begin();
+      for (RunList::iterator i = runs.begin(); i != runs.end(); ++i) {
+	int start = i->start + distance, end = i->end + distance;
+	if (distance > 0 && i->start == 0)
+	  start = 0;
+	if (distance < 0 && i->end == n)
+	  end = n;
+	start = std::max(start, 0);
+	end = std::min(end, n);
+	if (start < end)
+	  *(out++) = Run(start, end);
+      }
+      runs.erase(out, runs.end());
+    }
+
+    // Computes the y-projections of the first *n_strips* vertical strips of
+    // width *wid* into the strip-major buffer *strips*, like
+    // yproj_vertical_strips in staff_removal_fujinaga.hpp.  Each projection
+    // is the prefix sum of the run starts and ends in its strip.
+    void yproj_strips(IntVector& strips, int wid, int n_strips, int n_threads) const {
+      int nrows = int(m_nrows);
+      int ncols = int(m_columns.size());
+      strips.resize(size_t(n_strips) * nrows);
+
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+      for (int i = 0; i < n_strips; ++i) {
+	int begin = std::min(i * wid, ncols);
+	int end = std::min(begin + wid, ncols);
+	IntVector::iterator proj = strips.begin() + size_t(i) * nrows;
+	std::fill(proj, proj + nrows, 0);
+	for (int c = begin; c < end; ++c) {
+	  const RunList& runs = m_columns[c];
+	  for (RunList::const_iterator r = runs.begin(); r != runs.end(); ++r) {
+	    ++proj[r->start];
+	    if (r->end < nrows)
+	      --proj[r->end];
+	  }
+	}
+	for (int r = 1; r < nrows; ++r)
+	  proj[r] += proj[r - 1];
+      }
+    }
+
+    // Draws the runs into *image*, which must have the same size as the
+    // runs and be all white.  *image* may be of any onebit storage type.
+    template<class T>
+    void to_image(T& image) const {
+      typename T::col_iterator col = image.col_begin();
+      for (size_t c = 0; c < m_columns.size(); ++c, ++col) {
+	const RunList& runs = m_columns[c];
+	for (RunList::const_iterator r = runs.begin(); r != runs.end(); ++r) {
+	  typename T::col_iterator::iterator pixel = col.begin() + r->start;
+	  for (int i = r->start; i < r->end; ++i, ++pixel)
+	    *pixel = black(image);
+	}
+      }
+    }
+
+  private:
+    static size_t find(std::vector<size_t>& parent, size_t i) {
+      while (parent[i] != i) {
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+      }
+      return i;
+    }
+
+    size_t m_nrows;
+    std::vector<RunList> m_columns;
+  };
+
+}
+
+#endif
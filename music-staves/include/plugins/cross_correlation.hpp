@@ -0,0 +1,164 @@
+/*
+ *
+ * Copyright (C) 2000-2005 Ichiro Fujinaga, Michael Droettboom, and Karl MacMillan
+ * Copyright (C) 2026 MusicStaves Toolkit contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef mgd01042005_crosscorrelation
+#define mgd01042005_crosscorrelation
+
+// The projection cross-correlation used by the Fujinaga skew estimation
+// (see staff_removal_fujinaga.hpp).
+//
+// This header only depends on the standard library, so that it can also be
+// used by the microbenchmark in addons/benchmarks without a Gamera build.
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+namespace Aomr {
+
+  typedef std::vector<int> ProjVector;
+
+  // The original scalar implementation of cross_correlate.  It is kept as
+  // the reference for the faster engine below (and for benchmarking).
+  inline int cross_correlate_reference(ProjVector* proj1, ProjVector* proj2, int offset,
+				       int max_shift) {
+    if (proj1->size() != proj2->size())
+      throw std::length_error("cross_correlate proj1.size != proj2.size");
+
+    int i, j;
+    ProjVector::iterator old = proj1->begin();
+    ProjVector::iterator new_data = proj2->begin();
+    int n = int(proj1->size());
+    ProjVector::iterator new_limit;
+    int size = max_shift * 2 + 1;
+
+    ProjVector total(size);
+
+    if (offset >= 0) {
+      new_limit = new_data + (n - max_shift - offset - 1);
+      new_data += max_shift + offset;
+    } else {
+      // This looks a lot scarier than it is.  If -offset > proj1.size(), then
+      // new_limit ends up being < new_data, so the loop is never run anyway.
+      old -= offset;
+      new_limit = new_data + (n - max_shift + offset - 1);
+      new_data += max_shift;
+    }
+
+    for (; new_data < new_limit; old++, new_data++) {
+      if (*new_data != 0) {
+	ProjVector::iterator pold = old;
+	int newv = *new_data;
+
+	for (ProjVector::iterator ptot = total.begin(); ptot < total.end(); pold++, ptot++) {
+	  if (*pold != 0)
+	    *ptot += *pold * newv;
+	}
+      }
+    }
+
+    j = (std::max_element(total.begin(), total.end()) - total.begin()) - max_shift;
+    old = proj1->begin();
+
+    if (j == max_shift || -j == max_shift) {	/* ignore */
+      return (offset);
+    }
+    for (i = 0; i < size; i++)
+      if (total[i] != 0)
+	break;
+    if (i == size)
+      j = 0;
+    return (-j + offset);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // CORRELATION KERNEL
+  //
+  // Computes, for k = 0 ... size - 1,
+  //
+  //   total[k] = sum_{j = 0}^{len - 1} a[j] * b[j + k]
+  //
+  // where b must hold len + size - 1 values.
+
+  // For every nonzero a[j], adds a[j] * b[j ... j + size - 1]
+  // to the totals.  The inner loop is branch free and contiguous, so that the
+  // compiler turns it into SIMD code.  Unsigned arithmetic makes the
+  // wraparound on overflow identical to that of the reference implementation.
+  inline void correlation_totals_direct(const int* a, const int* b, int len, int size,
+					unsigned int* total) {
+    for (int j = 0; j < len; ++j) {
+      unsigned int v = (unsigned int)a[j];
+      if (v == 0)
+	continue;
+      const int* pb = b + j;
+      for (int k = 0; k < size; ++k)
+	total[k] += v * (unsigned int)pb[k];
+    }
+  }
+
+  // cross-correlates two sets of projections
+  //   proj1: the accumulated projection so far
+  //   proj2: the projection of the next strip
+  //   offset: the offset of the previous strip
+  //   max_shift: the largest shift relative to *offset* that is tested
+  // Returns the offset of proj2.  Shifts at the border of the window are
+  // ignored (*offset* is returned), and when there is no overlap at all
+  // *offset* is returned as well.
+  // Gives exactly the same results as cross_correlate_reference.
+  inline int cross_correlate(ProjVector* proj1, ProjVector* proj2, int offset, int max_shift) {
+    if (proj1->size() != proj2->size())
+      throw std::length_error("cross_correlate proj1.size != proj2.size");
+
+    int n = int(proj1->size());
+    int size = max_shift * 2 + 1;
+    // range of proj2 that is correlated, and the matching start in proj1
+    int lo = max_shift + std::max(offset, 0);
+    int hi = n - max_shift - std::abs(offset) - 1;
+
+    std::vector<unsigned int> utotal(size, 0);
+    if (lo < hi) {
+      const int* a = &(*proj2)[lo];
+      const int* b = &(*proj1)[lo - max_shift - offset];
+      int len = hi - lo;
+
+      correlation_totals_direct(a, b, len, size, &utotal[0]);
+    }
+
+    ProjVector total(size);
+    for (int k = 0; k < size; ++k)
+      total[k] = (int)utotal[k];
+
+    int j = (std::max_element(total.begin(), total.end()) - total.begin()) - max_shift;
+    if (j == max_shift || -j == max_shift) {	/* ignore */
+      return (offset);
+    }
+    int i;
+    for (i = 0; i < size; i++)
+      if (total[i] != 0)
+	break;
+    if (i == size)
+      j = 0;
+    return (-j + offset);
+  }
+
+}
+
+#endif
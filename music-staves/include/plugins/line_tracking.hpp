@@ -41,6 +41,9 @@ OneBitImageView* extract_filled_horizontal_black_runs(T&, int, size_t);
 template<class T>
 PyObject* thinning_v_to_skeleton_list(T&, int);
 
+template<class T>
+PyObject* thinning_v_to_skeleton_set(T&, int);
+
 template<class T>
 typename ImageFactory<T>::view_type* skeleton_list_to_image(T&, PyObject*);
 
@@ -63,7 +66,7 @@ static inline void label_pixels(T& image, size_t top, size_t middle,
                                 size_t bottom,
                                 size_t col, typename T::value_type label);
 
-static inline void interpolate(PyObject* y_values, size_t start_pos);
+static inline void interpolate(int* y_values, size_t size, size_t start_pos);
 
 template<class T>
 static inline int slither_midpoint(T& image, int col, int row, int staffline_height);
@@ -74,14 +77,62 @@ void remove_stave(T&, PyObject *, int, int);
 // private members
 static int staffline_height = 0;
 
+/****************************************************************
+ * SkeletonSet
+ *
+ * The staff line skeletons of a page in contiguous arrays
+ * instead of Python lists. Skeleton i starts at column
+ * left_x[i] and has the rows y[y_begin[i]] ... y[y_begin[i+1]-1];
+ * staff s consists of the skeletons staff_begin[s] ...
+ * staff_begin[s+1]-1. From Python, a SkeletonSet is held as a
+ * PyCObject by the class SkeletonSet in line_tracking.py.
+ ***************************************************************/
+
+struct SkeletonSet
+{
+  vector<int> staff_begin, left_x, y_begin, y;
+
+  SkeletonSet() : staff_begin(1, 0), y_begin(1, 0) {}
+
+  size_t n_staves() const { return staff_begin.size() - 1; }
+  size_t n_skeletons() const { return left_x.size(); }
+  int length(size_t i) const { return y_begin[i + 1] - y_begin[i]; }
+  const int* rows(size_t i) const { return y.empty() ? 0 : &y[0] + y_begin[i]; }
+  int* rows(size_t i) { return y.empty() ? 0 : &y[0] + y_begin[i]; }
+
+  // appends a skeleton to the current staff and a row to it
+  void add_skeleton(int x) { left_x.push_back(x); y_begin.push_back(y.size()); }
+  void add_row(int row) { y.push_back(row); y_begin.back()++; }
+  // the following skeletons belong to the next staff
+  void end_staff() { staff_begin.push_back(left_x.size()); }
+};
+
+// marks the PyCObjects that hold a SkeletonSet
+static char skeleton_set_desc[] = "SkeletonSet";
+
+bool is_skeleton_set(PyObject *skel_py)
+{
+  return PyCObject_Check(skel_py)
+    && PyCObject_GetDesc(skel_py) == (void *) skeleton_set_desc;
+}
+
+void skeleton_set_destructor(void *skel_set, void *)
+{
+  delete (SkeletonSet *) skel_set;
+}
+
+// Takes ownership of *skel_set*
+PyObject *skeleton_set_to_python(SkeletonSet *skel_set)
+{
+  return PyCObject_FromVoidPtrAndDesc(skel_set, skeleton_set_desc,
+                                      skeleton_set_destructor);
+}
+
 /*****************************************************************************
- * thinning_v_to_skeleton_list
+ * thinning_v_to_skeletons
  *
  * thinning of elements, so that (*always*) the vertical middle is found. the
- * return value is a skeleton list (a nested list) and it contains following
- * values:
- * [[x0, [yx00, yx01, ..., yx0nx0-1]], [x1, [yx10, yx11, yx1nx1-1]], ...,
- * [xn-1, [yxn-10, yxn-11, ..., yxn-1nxn-1-1]]]
+ * skeletons are appended to 'skel_set' as a single staff.
  *
  * note: the image is structured into elements that are labeled (so after
  *       applying this function the pixel values are never 'black value (1)',
@@ -92,7 +143,7 @@ static int staffline_height = 0;
  ****************************************************************************/
 
 template<class T>
-PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
+void thinning_v_to_skeletons(T& image, int sl_height, SkeletonSet& skel_set)
 {
 	typename T::value_type black_value=black(image);
 	typename T::value_type max_label=
@@ -115,13 +166,7 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
 	int start_pos;
 	int size;
 
-	PyObject* list;
-	PyObject* line;
-	PyObject* y_values;
-	PyObject* py_x;
-	PyObject* py_y;
-
-	list=PyList_New(0);
+	size_t skel;
 
 	// pixel values greater 1 are used to mark
 	// pixels that have already been scanned
@@ -137,12 +182,9 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
 			if (image.get(Point(col, row)) != black_value)
 				continue;
 
-			// initialize a python list for this line
-			line=PyList_New(2);
-			py_x=PyLong_FromLong(col);
-			y_values=PyList_New(0);
-			PyList_SetItem(line, 0, py_x);
-			PyList_SetItem(line, 1, y_values);
+			// start a skeleton for this line
+			skel=skel_set.n_skeletons();
+			skel_set.add_skeleton(col);
 
 			start_pos=0;
 
@@ -175,16 +217,14 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
 				middle=get_middle(top, middle, bottom,
 						&guessed, &wall);
 
-				// add the middle to the python list
-				py_y=PyLong_FromLong(middle);
-				PyList_Append(y_values, py_y);
-                Py_DECREF(py_y);
+				// add the middle to the skeleton
+				skel_set.add_row(middle);
 
 				/*
 				 * special cases where the last values for
 				 * the middle have to be adjusted
 				 */
-				size=PyList_GET_SIZE(y_values);
+				size=skel_set.length(skel);
 				if (wall) {
 					if (size < 6*staffline_height+1)
 						start_pos=0;
@@ -192,7 +232,8 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
 						start_pos=size-1-6*
 							staffline_height;
 
-					interpolate(y_values, start_pos);
+					interpolate(skel_set.rows(skel), size,
+							start_pos);
 
 					wall=false;
 					guessed=false;
@@ -205,7 +246,8 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
 				// middle got back its border lines, so try
 				// to correct the values from 'start_pos'
 				else if (!guessed && guessed_prev)
-					interpolate(y_values, start_pos);
+					interpolate(skel_set.rows(skel), size,
+							start_pos);
 
 				guessed_prev=guessed;
 
@@ -215,14 +257,62 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
 				cur_row=neighbor;
 				cur_col++;
 			} while (has_neighbor);
-
-			PyList_Append(list, line);
-            Py_DECREF(line);
 		}
 	}
+	skel_set.end_staff();
+}
+
+/*****************************************************************************
+ * thinning_v_to_skeleton_list
+ *
+ * thinning_v_to_skeletons with a skeleton list (a nested list) as return
+ * value. it contains following values:
+ * [[x0, [yx00, yx01, ..., yx0nx0-1]], [x1, [yx10, yx11, yx1nx1-1]], ...,
+ * [xn-1, [yxn-10, yxn-11, ..., yxn-1nxn-1-1]]]
+ *
+ * toom, 2005-02-21
+ ****************************************************************************/
+
+template<class T>
+PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
+{
+	SkeletonSet skel_set;
+	thinning_v_to_skeletons(image, sl_height, skel_set);
+
+	PyObject* list=PyList_New(skel_set.n_skeletons());
+	for (size_t skel=0; skel < skel_set.n_skeletons(); skel++) {
+		const int* rows=skel_set.rows(skel);
+		PyObject* y_values=PyList_New(skel_set.length(skel));
+		for (int i=0; i < skel_set.length(skel); i++)
+			PyList_SET_ITEM(y_values, i, PyLong_FromLong(rows[i]));
+		PyObject* line=PyList_New(2);
+		PyList_SET_ITEM(line, 0, PyLong_FromLong(skel_set.left_x[skel]));
+		PyList_SET_ITEM(line, 1, y_values);
+		PyList_SET_ITEM(list, skel, line);
+	}
 	return list;
 }
 
+/*****************************************************************************
+ * thinning_v_to_skeleton_set
+ *
+ * thinning_v_to_skeletons with a SkeletonSet (as a PyCObject) as return
+ * value, so that no Python object is created for the skeleton points.
+ ****************************************************************************/
+
+template<class T>
+PyObject* thinning_v_to_skeleton_set(T& image, int sl_height)
+{
+	SkeletonSet* skel_set=new SkeletonSet();
+	try {
+		thinning_v_to_skeletons(image, sl_height, *skel_set);
+	} catch (...) {
+		delete skel_set;
+		throw;
+	}
+	return skeleton_set_to_python(skel_set);
+}
+
 /*****************************************************************************
  * interpolate values of the list: adjust the values between 'start_pos' and
  * the last position in 'y_values'
@@ -230,22 +320,17 @@ PyObject* thinning_v_to_skeleton_list(T& image, int sl_height)
  * 2005-03-11
  ****************************************************************************/
 
-static inline void interpolate(PyObject* y_values, size_t start_pos)
+static inline void interpolate(int* y_values, size_t size, size_t start_pos)
 {
-	PyObject* py_y;
 	double x_diff, y_diff;
 	double tan_a;
 	int start_middle, cur_middle;
-	int size;
 
 	/*
 	 * get the needed middle values for computation from the list
 	 */
-	size=PyList_GET_SIZE(y_values);
-	py_y=PyList_GET_ITEM(y_values, start_pos);
-	start_middle=PyLong_AsLong(py_y);
-	py_y=PyList_GET_ITEM(y_values, size-1);
-	cur_middle=PyLong_AsLong(py_y);
+	start_middle=y_values[start_pos];
+	cur_middle=y_values[size-1];
 
 	/*
 	 * compute the angle
@@ -257,10 +342,8 @@ static inline void interpolate(PyObject* y_values, size_t start_pos)
 	/*
 	 * actual computation and resetting of the middle values
 	 */
-	for (size_t i=0; i < size-start_pos; i++) {
-		py_y=PyLong_FromDouble(i*tan_a+start_middle);
-		PyList_SET_ITEM(y_values, i+start_pos, py_y);
-	}
+	for (size_t i=0; i < size-start_pos; i++)
+		y_values[i+start_pos]=(int)(i*tan_a+start_middle);
 }
 
 /*****************************************************************************
@@ -476,7 +559,7 @@ static inline size_t up(T& image,
 /*****************************************************************************
  * skeleton_list_to_image
  *
- * convert the skeleton list 'list' to an image.
+ * convert the skeleton list 'list' (or a SkeletonSet) to an image.
  *
  * toom, 2005-02-23
  ****************************************************************************/
@@ -493,6 +576,24 @@ typename ImageFactory<T>::view_type* skeleton_list_to_image(T& image,
 
 	typename T::value_type black_value=black(*data);
 
+	if (is_skeleton_set(list)) {
+		const SkeletonSet& skel_set=
+			*(SkeletonSet*)PyCObject_AsVoidPtr(list);
+		for (size_t skel=0; skel < skel_set.n_skeletons(); skel++) {
+			const int* rows=skel_set.rows(skel);
+			size_t x=skel_set.left_x[skel];
+			for (int col=0; col < skel_set.length(skel); col++) {
+				if (x+col >= image.ncols() ||
+				    (size_t)rows[col] >= image.nrows())
+					throw std::runtime_error("Values out of"
+							" range.");
+				view->set(Point(x + col, rows[col]),
+						black_value);
+			}
+		}
+		return view;
+	}
+
 	if (!PyList_Check(list))
 		throw std::runtime_error("Must be a Python list.");
 
@@ -1025,70 +1126,24 @@ static inline int slither_midpoint(T& image,
   }
 }
 
-/****************************************************************
- * convert_skeleton
- *
- * Convenience function for converting a skeleton from
- * a PyObject to a Skeleton object.
- *
- * Florian Pose, 2005-09-13
- ***************************************************************/
-
-struct Skeleton
-{
-  int left_x;
-  list<int> y_list;
-};
-
-void convert_skeleton(PyObject *skel_py, Skeleton &skel)
-{
-  PyObject *pyob;
-  int len_y, x;
-
-  // Get leftmost column from PyObject
-  pyob = PyObject_GetAttrString(skel_py, "left_x");
-  if (!pyob) throw std::runtime_error("Skeleton has no left_x!");
-  skel.left_x = (size_t) PyLong_AsLong(pyob);
-  Py_DECREF(pyob);
-
-  // Get list of row values from PyObject
-  pyob = PyObject_GetAttrString(skel_py, "y_list");
-
-  if (!pyob) throw std::runtime_error("Skeleton has no y_list!");
-
-  if (!PyList_Check(pyob))
-  {
-    throw std::runtime_error("Skeleton y_list is no list!");
-  }
-
-  // Push all row values in a list
-  skel.y_list.clear();
-  len_y = PyList_Size(pyob);
-  for (x = 0; x < len_y; x++)
-  {
-    skel.y_list.push_back(PyInt_AsLong(PyList_GetItem(pyob, x)));
-  }
-  Py_DECREF(pyob);
-}
-
 /****************************************************************
  * convert_skeleton_list
  *
  * Convenience function for converting skeletons from
  * a PyObject containing a nested list with skeletons
- * to a std::list<Skeleton>.
+ * (objects with the attributes left_x and y_list) to a
+ * SkeletonSet.
  *
  * Florian Pose, 2005-09-13
  ***************************************************************/
 
 void convert_skeleton_list(PyObject *skel_list_py,
-                           list<Skeleton> &skel_list)
+                           SkeletonSet &skel_set)
 {
-  PyObject *pyob;
-  int i, len_i, j, len_j;
-  Skeleton skel;
+  PyObject *staff, *skel_py, *pyob;
+  int i, len_i, j, len_j, x, len_y;
 
-  skel_list.clear();
+  skel_set = SkeletonSet();
 
   if (!PyList_Check(skel_list_py))
   {
@@ -1098,42 +1153,142 @@ void convert_skeleton_list(PyObject *skel_list_py,
   len_i = PyList_Size(skel_list_py);
   for (i = 0; i < len_i; i++)
   {
-    pyob = PyList_GetItem(skel_list_py, i);
+    staff = PyList_GetItem(skel_list_py, i);
 
-    if (!PyList_Check(pyob))
+    if (!PyList_Check(staff))
     {
       throw std::runtime_error("Skeleton list param is no nested list!");
     }
 
-    len_j = PyList_Size(pyob);
+    len_j = PyList_Size(staff);
     for (j = 0; j < len_j; j++)
     {
-      convert_skeleton(PyList_GetItem(pyob, j), skel);
-      skel_list.push_back(skel);
+      skel_py = PyList_GetItem(staff, j);
+
+      // Get leftmost column from PyObject
+      pyob = PyObject_GetAttrString(skel_py, "left_x");
+      if (!pyob) throw std::runtime_error("Skeleton has no left_x!");
+      skel_set.add_skeleton((int) PyLong_AsLong(pyob));
+      Py_DECREF(pyob);
+
+      // Get list of row values from PyObject
+      pyob = PyObject_GetAttrString(skel_py, "y_list");
+
+      if (!pyob) throw std::runtime_error("Skeleton has no y_list!");
+
+      if (!PyList_Check(pyob))
+      {
+        Py_DECREF(pyob);
+        throw std::runtime_error("Skeleton y_list is no list!");
+      }
+
+      len_y = PyList_Size(pyob);
+      for (x = 0; x < len_y; x++)
+      {
+        skel_set.add_row(PyInt_AsLong(PyList_GET_ITEM(pyob, x)));
+      }
+      Py_DECREF(pyob);
     }
+    skel_set.end_staff();
+  }
+}
+
+/****************************************************************
+ * skeleton_set_from_python
+ *
+ * Returns the SkeletonSet held by *skel_py* when it is a
+ * PyCObject created by create_skeleton_set. Otherwise
+ * *skel_py* is a nested list of skeletons, which is converted
+ * into *buffer*.
+ ***************************************************************/
+
+const SkeletonSet &skeleton_set_from_python(PyObject *skel_py,
+                                            SkeletonSet &buffer)
+{
+  if (is_skeleton_set(skel_py))
+    return *(SkeletonSet *) PyCObject_AsVoidPtr(skel_py);
+  if (PyCObject_Check(skel_py))
+    throw std::runtime_error("Invalid SkeletonSet");
+  convert_skeleton_list(skel_py, buffer);
+  return buffer;
+}
+
+/****************************************************************
+ * create_skeleton_set
+ *
+ * Converts a nested list of skeletons (as returned by
+ * StaffFinder.get_skeleton) to a SkeletonSet.
+ ***************************************************************/
+
+PyObject *create_skeleton_set(PyObject *skel_list_py)
+{
+  SkeletonSet *skel_set = new SkeletonSet();
+  try
+  {
+    convert_skeleton_list(skel_list_py, *skel_set);
   }
+  catch (...)
+  {
+    delete skel_set;
+    throw;
+  }
+  return skeleton_set_to_python(skel_set);
+}
+
+/****************************************************************
+ * skeleton_set_arrays
+ *
+ * Returns the arrays staff_begin, left_x, y_begin and y of a
+ * SkeletonSet as strings of native ints, which can be read
+ * with array.array('i').
+ ***************************************************************/
+
+static PyObject *int_array_to_string(const vector<int> &values)
+{
+  if (values.empty())
+    return PyString_FromStringAndSize("", 0);
+  return PyString_FromStringAndSize((const char *) &values[0],
+                                    values.size() * sizeof(int));
+}
+
+PyObject *skeleton_set_arrays(PyObject *skel_py)
+{
+  if (!is_skeleton_set(skel_py))
+    throw std::runtime_error("Invalid SkeletonSet");
+  const SkeletonSet &skel_set = *(SkeletonSet *) PyCObject_AsVoidPtr(skel_py);
+  return Py_BuildValue("(NNNN)",
+                       int_array_to_string(skel_set.staff_begin),
+                       int_array_to_string(skel_set.left_x),
+                       int_array_to_string(skel_set.y_begin),
+                       int_array_to_string(skel_set.y));
 }
 
 /****************************************************************
  * get_staffline_slice
  *
- * Returns a list of rows that belong to a vertical "slice"
+ * Determines the rows that belong to a vertical "slice"
  * of a staff line. Gaps are allowed, if the parameter
  * *max_gap_height* is greater zero. The maximum height of the
- * returned slice is limited by *threshold* in both upper
- * and lower direction. Thus, the maximum returned height ist
+ * slice is limited by *threshold* in both upper
+ * and lower direction. Thus, the maximum height ist
  * *threshold* * 2.
  *
+ * As the slice consists of all black rows between its first
+ * and its last row, only these are returned in *top* and
+ * *bottom*, so that no list has to be built for every
+ * skeleton point. Returns false, when the slice is empty.
+ *
  * Florian Pose, 2005-09-29
  ***************************************************************/
 
 template<class T>
-list<int> get_staffline_slice(T& image, int root_row, int root_col,
-                              int threshold, int max_gap_height)
+bool get_staffline_slice(T& image, int root_row, int root_col,
+                         int threshold, int max_gap_height,
+                         int& top, int& bottom)
 {
   typename T::value_type black_value;
   int gap, row;
-  list<int> slice;
+  bool found = false;
 
   black_value = black(image);
 
@@ -1144,7 +1299,9 @@ list<int> get_staffline_slice(T& image, int root_row, int root_col,
   {
     if (image.get(Point(root_col, row)) == black_value)
     {
-      slice.push_back(row);
+      if (!found) bottom = row;
+      top = row;
+      found = true;
       gap = max_gap_height; // Reset gap tolerance
     }
     else if (gap-- == 0) break;
@@ -1152,8 +1309,6 @@ list<int> get_staffline_slice(T& image, int root_row, int root_col,
     row--;
   }
 
-  slice.reverse();
-
   // Determine black runlength below point
   gap = max_gap_height;
   row = root_row + 1;
@@ -1161,7 +1316,9 @@ list<int> get_staffline_slice(T& image, int root_row, int root_col,
   {
     if (image.get(Point(root_col, row)) == black_value)
     {
-      slice.push_back(row);
+      if (!found) top = row;
+      bottom = row;
+      found = true;
       gap = max_gap_height; // Reset gap tolerance
     }
     else if (gap-- == 0) break;
@@ -1169,7 +1326,7 @@ list<int> get_staffline_slice(T& image, int root_row, int root_col,
     row++;
   }
 
-  return slice;
+  return found;
 }
 
 /****************************************************************
@@ -1191,36 +1348,34 @@ void remove_line_around_skeletons(T& image,
                                   int max_gap_height)
 {
   typename T::value_type white_value;
-  list<Skeleton> skel_list;
-  list<Skeleton>::const_iterator skel_i;
-  list<int>::const_iterator y_i;
-  int start_row, end_row, x, y;
-  list<int> slice;
+  SkeletonSet buffer;
+  const int *y_i, *y_end;
+  size_t skel_i;
+  int top, bottom, start_row, end_row, x, y;
 
   white_value = white(image);
 
-  // Convert skeleton list
-  convert_skeleton_list(skel_list_py, skel_list);
+  // Get the skeletons, converting a skeleton list
+  const SkeletonSet &skel_set = skeleton_set_from_python(skel_list_py, buffer);
 
   // For every skeleton
-  for (skel_i = skel_list.begin(); skel_i != skel_list.end(); skel_i++)
+  for (skel_i = 0; skel_i < skel_set.n_skeletons(); skel_i++)
   {
     // For every point on the skeleton
-    for (x = skel_i->left_x, y_i = skel_i->y_list.begin();
-         y_i != skel_i->y_list.end();
+    for (x = skel_set.left_x[skel_i], y_i = skel_set.rows(skel_i),
+           y_end = y_i + skel_set.length(skel_i);
+         y_i != y_end;
          x++, y_i++)
     {
       // Get staffline "slice"
-      slice = get_staffline_slice(image, *y_i, x,
-                                  threshold, max_gap_height);
-
-      if (!slice.size()) continue;
+      if (!get_staffline_slice(image, *y_i, x, threshold,
+                               max_gap_height, top, bottom)) continue;
 
-      if (slice.back() - slice.front() <= threshold)
+      if (bottom - top <= threshold)
       {
         // If runlength is within the threshold, remove everything
-        start_row = slice.front();
-        end_row = slice.back();
+        start_row = top;
+        end_row = bottom;
       }
       else
       {
@@ -1257,24 +1412,25 @@ void rescue_stafflines_using_mask(T& rescue_image,
                                   int threshold)
 {
   typename T::value_type black_value, white_value;
-  list<Skeleton> skel_list;
-  list<Skeleton>::const_iterator skel_i;
-  list<int>::const_iterator y_i;
+  SkeletonSet buffer;
+  const int *y_i, *y_end;
+  size_t skel_i;
   int x, ya, yb;
 
   // Determine black and white values
   black_value = black(rescue_image);
   white_value = white(rescue_image);
 
-  // Convert skeleton list
-  convert_skeleton_list(skel_list_py, skel_list);
+  // Get the skeletons, converting a skeleton list
+  const SkeletonSet &skel_set = skeleton_set_from_python(skel_list_py, buffer);
 
   // For every skeleton
-  for (skel_i = skel_list.begin(); skel_i != skel_list.end(); skel_i++)
+  for (skel_i = 0; skel_i < skel_set.n_skeletons(); skel_i++)
   {
     // For every point on the skeleton
-    for (x = skel_i->left_x, y_i = skel_i->y_list.begin();
-         y_i != skel_i->y_list.end();
+    for (x = skel_set.left_x[skel_i], y_i = skel_set.rows(skel_i),
+           y_end = y_i + skel_set.length(skel_i);
+         y_i != y_end;
          x++, y_i++)
     {
       ya = *y_i - threshold;
@@ -1760,21 +1916,20 @@ void rescue_secondchord(T &rescue_image,
           }
         }
         else {
-          list<int> slice;
-          list<int>::const_iterator slice_i;
-
-          // Rescue the vertical staff line slice
-          slice = get_staffline_slice(original_image, y, x,
-                                      threshold, max_gap_height);
-          if (slice.back() - slice.front() > threshold) {
-            while (slice.size() && slice.front() < y - staffline_height / 2)
-              slice.pop_front();
-            while (slice.size() && slice.back() > y + staffline_height / 2)
-              slice.pop_back();
+          int top, bottom;
+
+          // Rescue the black rows of the vertical staff line slice
+          if (!get_staffline_slice(original_image, y, x, threshold,
+                                   max_gap_height, top, bottom))
+            return;
+          if (bottom - top > threshold) {
+            top = max(top, y - staffline_height / 2);
+            bottom = min(bottom, y + staffline_height / 2);
+          }
+          for (int row = top; row <= bottom; row++) {
+            if (original_image.get(Point(x, row)) == black(original_image))
+              rescue_image.set(Point(x, row), black_value);
           }
-          for (slice_i = slice.begin(); slice_i != slice.end(); slice_i++) {
-            rescue_image.set(Point(x, *slice_i), black_value);
-          }         
         }
 }
 
@@ -1827,9 +1982,9 @@ void rescue_stafflines_using_secondchord(T &rescue_image,
   typename T::value_type black_value;
   int x, histindex;
   unsigned int limit;
-  list<Skeleton> skel_list;
-  list<Skeleton>::const_iterator skel_i;
-  list<int>::const_iterator y_i;
+  SkeletonSet buffer;
+  const int *y_i, *y_end;
+  size_t skel_i;
   ExtAngle a;
   vector<ExtAngle> thetas;
   vector<ExtAngle>::const_iterator theta_i;
@@ -1851,19 +2006,20 @@ void rescue_stafflines_using_secondchord(T &rescue_image,
     thetas.push_back(a);
   }
 
-  // Convert skeleton to integer list
-  convert_skeleton_list(skel_list_py, skel_list);
+  // Get the skeletons, converting a skeleton list
+  const SkeletonSet &skel_set = skeleton_set_from_python(skel_list_py, buffer);
 
-  progress_bar.set_length(skel_list.size());
+  progress_bar.set_length(skel_set.n_skeletons());
 
   // For every skeleton
-  for (skel_i = skel_list.begin(); skel_i != skel_list.end(); skel_i++)
+  for (skel_i = 0; skel_i < skel_set.n_skeletons(); skel_i++)
   {
     progress_bar.step();
 
     // For every point on the skeleton
-    for (x = skel_i->left_x, y_i = skel_i->y_list.begin();
-         y_i != skel_i->y_list.end();
+    for (x = skel_set.left_x[skel_i], y_i = skel_set.rows(skel_i),
+           y_end = y_i + skel_set.length(skel_i);
+         y_i != y_end;
          x++, y_i++)
     {
 #ifdef DEBUG_SECONDCHORD
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2026 MusicStaves Toolkit contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * musicstaves_parallel.hpp
+ *
+ * Helpers shared by the multithreaded code paths of the plugins.
+ *
+ * The parallel loops are written as OpenMP pragmas. When the toolkit is
+ * compiled without OpenMP (see setup.py), the pragmas are ignored and
+ * every "parallel" code path runs in the calling thread.
+ *
+ * Code inside a parallel region must neither call the Python C-API
+ * (this includes ProgressBar) nor let exceptions escape.
+ */
+
+#ifndef MUSICSTAVES_PARALLEL_2026
+#define MUSICSTAVES_PARALLEL_2026
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Returns the number of threads to use for a requested *n_threads*.
+// Values <= 0 mean "as many as available", 1 means serial execution.
+inline int musicstaves_num_threads(int n_threads) {
+#ifdef _OPENMP
+  if (n_threads <= 0)
+    return omp_get_max_threads();
+  return n_threads;
+#else
+  return 1;
+#endif
+}
+
+#endif
@@ -29,6 +29,27 @@
 #include <math.h>
 #include "plugins/segmentation.hpp"
 #include "plugins/image_utilities.hpp"
+#include "musicstaves_parallel.hpp"
+
+// bits per word of the packed tiles in compute_vector_field
+#define RT_WORD_BITS (sizeof(unsigned long) * 8)
+
+// The angles of the vector field are stored as they are in FLOAT images.
+// In GREYSCALE images they are quantized to 128 + angle / pi * 127, so
+// that 128 is a horizontal line to the right, and one step is about 1.4
+// degrees. The value 0 stands for no angle (white pixels).
+inline FloatPixel rt_encode_angle(double angle, FloatPixel) {
+  return angle;
+}
+inline GreyScalePixel rt_encode_angle(double angle, GreyScalePixel) {
+  return GreyScalePixel(128 + int(floor(angle / M_PI * 127.0 + 0.5)));
+}
+inline double rt_decode_angle(FloatPixel theta) {
+  return theta;
+}
+inline double rt_decode_angle(GreyScalePixel theta) {
+  return (double(theta) - 128.0) * M_PI / 127.0;
+}
 
 struct WindowPoint {
   WindowPoint(unsigned char r_, unsigned char c_, double distance_, double angle_) :
@@ -53,8 +74,170 @@ bool window_point_sorter(const WindowPoint& a, const WindowPoint& b) {
   return a.distance > b.distance;
 }
 
-template<class T>
-void compute_vector_field(const T& image, FloatImageView& theta_image, const int window_radius) {
+// The window filter of compute_vector_field. A black window point is
+// removed when one of its adjacent points (the neighbours that are closer
+// to the center in about the same direction) is white, and this is
+// repeated until nothing changes. The angle of the first remaining point
+// (in order of decreasing distance) is the angle of the line.
+// The filters test the window around bit *center* of a tile packed by
+// rt_vector_field_tiles and return the index of that point. Copies share
+// the window description, but not their scratch space.
+class RTIterativeFilter {
+public:
+  RTIterativeFilter(const std::vector<long>& offsets, const std::vector<int>& adjacent)
+    : m_offsets(&offsets), m_adjacent(&adjacent), m_value(offsets.size()) {}
+
+  size_t operator()(const unsigned long* tile, long center) {
+    const std::vector<long>& offsets = *m_offsets;
+    size_t n_points = offsets.size();
+    size_t first_black = n_points;
+    for (size_t i = 0; i != n_points; ++i) {
+      long b = center + offsets[i];
+      m_value[i] = (tile[b / RT_WORD_BITS] >> (b % RT_WORD_BITS)) & 1;
+      if (m_value[i] && first_black == n_points)
+        first_black = i;
+    }
+
+    bool filtered = false;
+    do {
+      filtered = false;
+      for (size_t i = first_black; i < n_points; ++i) {
+        if (m_value[i]) {
+          if (first_black == n_points)
+            first_black = i;
+          for (const int* adj = &(*m_adjacent)[i * 6]; *adj >= 0; ++adj) {
+            if (!m_value[*adj]) {
+              m_value[i] = false;
+              filtered = true;
+              if (i == first_black)
+                first_black = n_points;
+            }
+          }
+        }
+      }
+    } while (filtered);
+    return first_black;
+  }
+
+private:
+  const std::vector<long>* m_offsets;
+  const std::vector<int>* m_adjacent;
+  std::vector<char> m_value;
+};
+
+// The same filter for windows of at most WORDS * RT_WORD_BITS points.
+// Adjacent points always come later in the window, so a point survives the
+// filter exactly when it and all points reachable from it over adjacency
+// are black. These reachable sets are precomputed as bit sets in window
+// order, and the first surviving point is found by testing the black
+// points in order against the bit set of the white points, a word at a
+// time. (The center point has no adjacent points, so one always survives.)
+// *reachable* holds these bit sets, WORDS words per point (see
+// rt_compute_vector_field).
+template<size_t WORDS>
+class RTBitsetFilter {
+public:
+  RTBitsetFilter(const std::vector<long>& offsets, const std::vector<unsigned long>& reachable)
+    : m_offsets(&offsets), m_reachable(&reachable) {}
+
+  size_t operator()(const unsigned long* tile, long center) {
+    const std::vector<long>& offsets = *m_offsets;
+    size_t n_points = offsets.size();
+    unsigned long white[WORDS];
+    for (size_t w = 0; w != WORDS; ++w)
+      white[w] = 0;
+    for (size_t i = 0; i != n_points; ++i) {
+      long b = center + offsets[i];
+      if (!((tile[b / RT_WORD_BITS] >> (b % RT_WORD_BITS)) & 1))
+        white[i / RT_WORD_BITS] |= 1UL << (i % RT_WORD_BITS);
+    }
+
+    const unsigned long* reachable = &(*m_reachable)[0];
+    for (size_t i = 0; i != n_points; ++i) {
+      if ((white[i / RT_WORD_BITS] >> (i % RT_WORD_BITS)) & 1)
+        continue;
+      const unsigned long* r = reachable + i * WORDS;
+      size_t w = i / RT_WORD_BITS;
+      while (w != WORDS && !(r[w] & white[w]))
+        ++w;
+      if (w == WORDS)
+        return i;
+    }
+    return n_points;
+  }
+
+private:
+  const std::vector<long>* m_offsets;
+  const std::vector<unsigned long>* m_reachable;
+};
+
+// Stores the angle found by *filter* for each black pixel of *image* in
+// *theta_image* (the angle of window point i is stored as *angles[i]*),
+// and 0 for each white pixel. The image is processed in tiles of rows.
+// Each tile is packed into bits together with a white border of
+// window_radius pixels (instead of padding the whole image), and the
+// tiles are distributed among the threads in batches, so that the
+// progress bar can be updated in between. Every thread works on its own
+// copy of *filter*.
+template<class T, class V, class F>
+void rt_vector_field_tiles(const T& image, V& theta_image, int window_radius,
+                           const std::vector<typename V::value_type>& angles, const F& filter,
+                           int n_threads, ProgressBar& progress_bar) {
+  int nrows = int(image.nrows()), ncols = int(image.ncols());
+  size_t row_words = (ncols + 2 * window_radius + RT_WORD_BITS - 1) / RT_WORD_BITS;
+  long row_bits = long(row_words * RT_WORD_BITS);
+  const int tile_rows = 32;
+  int n_tiles = (nrows + tile_rows - 1) / tile_rows;
+  n_threads = musicstaves_num_threads(n_threads);
+  int batch = n_threads * 4;
+  progress_bar.set_length(n_tiles);
+
+  for (int first_tile = 0; first_tile < n_tiles; first_tile += batch) {
+    int last_tile = std::min(first_tile + batch, n_tiles);
+#pragma omp parallel num_threads(n_threads)
+    {
+      std::vector<unsigned long> tile;
+      F window_filter(filter);
+
+#pragma omp for schedule(dynamic)
+      for (int t = first_tile; t < last_tile; ++t) {
+        int r_begin = t * tile_rows;
+        int r_end = std::min(r_begin + tile_rows, nrows);
+        int tile_top = r_begin - window_radius;
+        int tile_nrows = r_end - r_begin + 2 * window_radius;
+        tile.assign(tile_nrows * row_words, 0);
+        for (int tr = 0; tr != tile_nrows; ++tr) {
+          int r = tile_top + tr;
+          if (r < 0 || r >= nrows)
+            continue;
+          typename T::const_row_iterator row = image.row_begin() + r;
+          typename T::const_row_iterator::iterator pixel = row.begin();
+          long bit = long(tr) * row_bits + window_radius;
+          for (int c = 0; c != ncols; ++c, ++pixel, ++bit)
+            if (is_black(*pixel))
+              tile[bit / RT_WORD_BITS] |= 1UL << (bit % RT_WORD_BITS);
+        }
+
+        for (int r = r_begin; r != r_end; ++r) {
+          long center = long(r - tile_top) * row_bits + window_radius;
+          for (int c = 0; c != ncols; ++c) {
+            long bit = center + c;
+            if ((tile[bit / RT_WORD_BITS] >> (bit % RT_WORD_BITS)) & 1)
+              theta_image.set(Point(c, r), angles[window_filter(&tile[0], bit)]);
+            else
+              theta_image.set(Point(c, r), typename V::value_type());
+          }
+        }
+      }
+    }
+    for (int t = first_tile; t < last_tile; ++t)
+      progress_bar.step();
+  }
+}
+
+template<class T, class V>
+void rt_compute_vector_field(const T& image, V& theta_image, const int window_radius,
+                             int n_threads, ProgressBar& progress_bar) {
   if (window_radius < 1)
     throw std::runtime_error("Window radius must be >= 1");
 
@@ -93,76 +276,95 @@ void compute_vector_field(const T& image, FloatImageView& theta_image, const int
     }
   }
 
-  typename ImageFactory<T>::view_type* padded_image = pad_image_default
-    (image, window_radius, window_radius, window_radius, window_radius);
-
-  try {
-    for (size_t r = 0; r != image.nrows(); ++r) {
-      std::cerr << (double)r / (double)image.nrows() << "\r";
-      for (size_t c = 0; c != image.ncols(); ++c) {
-	if (is_black(image.get(Point(c, r)))) {
-	  WindowPointVector::iterator first_black = points.end();
-	  WindowPointVector::iterator wp = points.begin();
-
-	  // Copy up to the first black value
-	  for (; wp != points.end(); ++wp) {
-	    int r0 = (int)r + (*wp).r;
-	    int c0 = (int)c + (*wp).c;
-	    bool value = is_black(padded_image->get(Point(c0, r0)));
-	    (*wp).value = value;
-	    if (value) {
-	      first_black = wp;
-	      break;
-	    }
-	  }
-
-	  // Copy the rest
-	  for (; wp != points.end(); ++wp) {
-	    int r0 = (int)r + (*wp).r;
-	    int c0 = (int)c + (*wp).c;
-	    (*wp).value = is_black(padded_image->get(Point(c0, r0)));
-	  }
+  // The window in a form that is shared by all threads: the position of
+  // each point relative to the center bit of a packed tile, its angle and
+  // its adjacent points as indices (terminated by -1)
+  size_t n_points = points.size();
+  std::vector<long> offsets(n_points);
+  std::vector<typename V::value_type> angles(n_points);
+  std::vector<int> adjacent(n_points * 6, -1);
+  size_t row_words = (image.ncols() + 2 * window_radius + RT_WORD_BITS - 1) / RT_WORD_BITS;
+  long row_bits = long(row_words * RT_WORD_BITS);
+  for (size_t i = 0; i != n_points; ++i) {
+    offsets[i] = long(points[i].r - window_radius) * row_bits + points[i].c - window_radius;
+    angles[i] = rt_encode_angle(points[i].angle, typename V::value_type());
+    for (size_t j = 0; j != 5 && points[i].adjacent[j] != NULL; ++j)
+      adjacent[i * 6 + j] = int(points[i].adjacent[j] - &points[0]);
+  }
 
-	  // Filter the window
-	  bool filtered = false;
-	  do {
-	    filtered = false;
-	    for (wp = first_black; wp != points.end(); ++wp) {
-	      if ((*wp).value) {
-		if (first_black == points.end())
-		  first_black = wp;
-		for (WindowPoint** adj = (*wp).adjacent; *adj != NULL; ++adj) {
-		  if (!(*adj)->value) {
-		    (*wp).value = false;
-		    filtered = true;
-		    if (wp == first_black) {
-		      first_black = points.end();
-		    }
-		  }
-		}
-	      }
-	    }
-	  } while (filtered);
-
-	  // r_image.set(r, c, (*wp).distance);
-	  theta_image.set(Point(c, r), (*first_black).angle);
-	}
+  // windows of up to 10 words (i.e. a radius of up to 12) are filtered on
+  // bit sets
+  size_t n_words = (n_points + RT_WORD_BITS - 1) / RT_WORD_BITS;
+  std::vector<unsigned long> reachable;
+  if (n_words <= 10) {
+    // the points reachable over adjacency from each point, built from the
+    // last point to the first (adjacent points always come later)
+    reachable.assign(n_points * n_words, 0);
+    for (size_t i = n_points; i-- != 0; ) {
+      unsigned long* r = &reachable[i * n_words];
+      for (const int* adj = &adjacent[i * 6]; *adj >= 0; ++adj) {
+        const unsigned long* r0 = &reachable[*adj * n_words];
+        for (size_t w = 0; w != n_words; ++w)
+          r[w] |= r0[w];
+        r[*adj / RT_WORD_BITS] |= 1UL << (*adj % RT_WORD_BITS);
       }
     }
-  } catch (std::exception e) {
-    delete padded_image->data(); delete padded_image;
   }
-  delete padded_image->data(); delete padded_image;
+  switch (n_words) {
+#define RT_BITSET_CASE(words)                                           \
+  case words:                                                           \
+    rt_vector_field_tiles(image, theta_image, window_radius, angles,    \
+                          RTBitsetFilter<words>(offsets, reachable),    \
+                          n_threads, progress_bar);                     \
+    break;
+  RT_BITSET_CASE(1) RT_BITSET_CASE(2) RT_BITSET_CASE(3) RT_BITSET_CASE(4)
+  RT_BITSET_CASE(5) RT_BITSET_CASE(6) RT_BITSET_CASE(7) RT_BITSET_CASE(8)
+  RT_BITSET_CASE(9) RT_BITSET_CASE(10)
+#undef RT_BITSET_CASE
+  default:
+    rt_vector_field_tiles(image, theta_image, window_radius, angles,
+                          RTIterativeFilter(offsets, adjacent),
+                          n_threads, progress_bar);
+  }
+}
+
+// Computes the angle of the line through each black pixel of *image* into
+// *theta_image*, with *n_threads* threads (see musicstaves_parallel.hpp).
+// In a GREYSCALE *theta_image* the angles are quantized (see rt_encode_angle).
+template<class T>
+void compute_vector_field(const T& image, FloatImageView& theta_image, const int window_radius,
+                          int n_threads = 1, ProgressBar progress_bar = ProgressBar()) {
+  rt_compute_vector_field(image, theta_image, window_radius, n_threads, progress_bar);
 }
 
 template<class T>
-FloatImageView* compute_vector_field(const T& image, const int window_size) {
+void compute_vector_field(const T& image, GreyScaleImageView& theta_image, const int window_radius,
+                          int n_threads = 1, ProgressBar progress_bar = ProgressBar()) {
+  rt_compute_vector_field(image, theta_image, window_radius, n_threads, progress_bar);
+}
+
+template<class T>
+Image* compute_vector_field(const T& image, const int window_size,
+                            int n_threads, bool quantized, ProgressBar progress_bar) {
+  if (quantized) {
+    GreyScaleImageData* theta_image_data = new GreyScaleImageData(Dim(image.ncols(), image.nrows()),
+                                                                  Point(image.offset_x(), image.offset_y()));
+    GreyScaleImageView* theta_image = new GreyScaleImageView(*theta_image_data);
+    try {
+      compute_vector_field(image, *theta_image, window_size, n_threads, progress_bar);
+    } catch (std::exception e) {
+      delete theta_image_data; delete theta_image;
+      throw;
+    }
+    return theta_image;
+  }
+
   FloatImageData* theta_image_data = new FloatImageData(Dim(image.ncols(), image.nrows()),
                                                         Point(image.offset_x(), image.offset_y()));
   FloatImageView* theta_image = new FloatImageView(*theta_image_data);
 
   try {
-    compute_vector_field(image, *theta_image, window_size);
+    compute_vector_field(image, *theta_image, window_size, n_threads, progress_bar);
   } catch (std::exception e) {
     delete theta_image_data; delete theta_image;
     throw;
@@ -172,6 +374,15 @@ FloatImageView* compute_vector_field(const T& image, const int window_size) {
 }
 
 
+// Marks the horizontal line pixels in *lines* and the questionable pixels
+// in *question*, which must both be white. *theta_image* is a vector field
+// as computed by compute_vector_field (FLOAT or quantized GREYSCALE).
+// All rules are applied in a single pass over the rows, keeping the last
+// four rows of the image, the lines and the questionable pixels in ring
+// buffers. The rules of a row are applied as soon as the rows they read
+// are final, i.e. the questionable pixel rules lag two rows behind the
+// line rules, which gives the same result as applying every rule to the
+// whole image before the next one.
 template<class T, class U, class V>
 void mark_horizontal_lines_rt(T& image, U& theta_image, V& lines,
     V& question, double angle_threshold, FloatImageView* thickness_image,
@@ -179,106 +390,132 @@ void mark_horizontal_lines_rt(T& image, U& theta_image, V& lines,
 {
   angle_threshold = (angle_threshold / 180.0) * M_PI;
 
-  // The following iterations correspond to the horizontal line rules in section 3.4
-  // It doesn't make sense to apply them in the order in the paper, however.
-
-  // Line rule #2: A black pixel is a horizontal line pixel if it is
-  // horizontal and 8-adjacent to a line pixel (The 8-adjacent part is
-  // taken care of by the cc_analysis step below
-  // ADDED FEATURE: A black pixel is a horizontal line pixel if its thickness
-  //                is not bigger than staffline_height (toom, Dalitz)
-  for (size_t r = 0; r != image.nrows(); ++r) {
-    for (size_t c = 0; c != image.ncols(); ++c) {
-      if (is_black(image.get(Point(c, r)))) {
-        double theta = abs(theta_image.get(Point(c, r)));
-
-        if (thickness_image == (FloatImageView*)NULL) {
-          if (theta < angle_threshold)
-            lines.set(Point(c, r), 1);
-        } else {
-          double thickness=thickness_image->get(Point(c, r));
-          if (theta < angle_threshold && thickness <= staffline_height)
-            lines.set(Point(c, r), 1);
-        }
+  int nrows = int(image.nrows()), ncols = int(image.ncols());
+  std::vector<unsigned char> image_rows(4 * ncols), line_rows(4 * ncols),
+    question_rows(4 * ncols);
+
+  for (int k = 0; k < nrows + 2; ++k) {
+    if (k < nrows) {
+      unsigned char* img = &image_rows[(k & 3) * ncols];
+      unsigned char* line = &line_rows[(k & 3) * ncols];
+      std::fill(line, line + ncols, 0);
+      std::fill(&question_rows[(k & 3) * ncols], &question_rows[(k & 3) * ncols] + ncols, 0);
+
+      typename T::row_iterator image_row = image.row_begin() + k;
+      typename T::row_iterator::iterator pixel = image_row.begin();
+      for (int c = 0; c != ncols; ++c, ++pixel)
+        img[c] = is_black(*pixel);
+
+      // The following rules correspond to the horizontal line rules in section 3.4
+      // It doesn't make sense to apply them in the order in the paper, however.
+
+      // Line rule #2: A black pixel is a horizontal line pixel if it is
+      // horizontal and 8-adjacent to a line pixel (The 8-adjacent part is
+      // taken care of by the cc_analysis step below
+      // ADDED FEATURE: A black pixel is a horizontal line pixel if its thickness
+      //                is not bigger than staffline_height (toom, Dalitz)
+      typename U::row_iterator theta_row = theta_image.row_begin() + k;
+      typename U::row_iterator::iterator theta = theta_row.begin();
+      if (thickness_image == (FloatImageView*)NULL) {
+        for (int c = 0; c != ncols; ++c, ++theta)
+          if (img[c] && abs(rt_decode_angle(*theta)) < angle_threshold)
+            line[c] = 1;
+      } else {
+        FloatImageView::row_iterator thickness_row = thickness_image->row_begin() + k;
+        FloatImageView::row_iterator::iterator thickness = thickness_row.begin();
+        for (int c = 0; c != ncols; ++c, ++theta, ++thickness)
+          if (img[c] && abs(rt_decode_angle(*theta)) < angle_threshold && *thickness <= staffline_height)
+            line[c] = 1;
       }
-    }
-  }
-
-  // Line rule #1: a black pixel is a horizontal line pixel if it is
-  // to the left or right of a line pixel
-  for (size_t r = 0; r != image.nrows(); ++r) {
-    for (size_t c = 1; c != image.ncols() - 1; ++c) {
-      if (is_black(image.get(Point(c, r))))
-	if (lines.get(Point(c - 1, r)) == 1 || lines.get(Point(c + 1, r)) == 1)
-	  lines.set(Point(c, r), 2);
-    }
-  }
-
-  // Line rule #3: a white pixel is a horizontal line pixel if it has
-  // a marked pixel to its left and its right
-  for (size_t r = 0; r != image.nrows(); ++r) {
-    for (size_t c = 1; c != image.ncols() - 1; ++c) {
-      if (is_white(image.get(Point(c, r))))
- 	if (lines.get(Point(c - 1, r)) != 0 && lines.get(Point(c + 1, r)) != 0)
- 	  lines.set(Point(c, r), 3);
-    }
-  }
 
-  // Set all black values to 1
-  for (size_t r = 0; r != image.nrows(); ++r) {
-    for (size_t c = 0; c != image.ncols(); ++c) {
-      if (lines.get(Point(c, r)) != 0)
-	lines.set(Point(c, r), 1);
+      // Line rule #1: a black pixel is a horizontal line pixel if it is
+      // to the left or right of a line pixel
+      for (int c = 1; c < ncols - 1; ++c)
+        if (img[c] && (line[c - 1] == 1 || line[c + 1] == 1))
+          line[c] = 2;
+
+      // Line rule #3: a white pixel is a horizontal line pixel if it has
+      // a marked pixel to its left and its right
+      for (int c = 1; c < ncols - 1; ++c)
+        if (!img[c] && line[c - 1] != 0 && line[c + 1] != 0)
+          line[c] = 3;
+
+      // Set all black values to 1
+      for (int c = 0; c != ncols; ++c)
+        line[c] = line[c] != 0;
     }
-  }
-
-  // The following iterations correspond to the questionable pixel rules in section 3.4
-  // It doesn't make sense to apply them in the order in the paper, however.
 
-  // Questionable rule #1: if it is not horizontal and is above or below a line pixel
-  for (size_t r = 1; r != image.nrows() - 1; ++r) {
-    for (size_t c = 0; c != image.ncols(); ++c) {
-      if (is_black(image.get(Point(c, r))))
-	if (is_white(lines.get(Point(c, r))) && (is_black(lines.get(Point(c, r + 1)))
-                                             || is_black(lines.get(Point(c, r - 1)))))
-	  question.set(Point(c, r), black(question));
+    // The following rules correspond to the questionable pixel rules in section 3.4
+    // It doesn't make sense to apply them in the order in the paper, however.
+
+    // Questionable rule #1: if it is not horizontal and is above or below a line pixel
+    int r = k - 1;
+    if (r >= 1 && r < nrows - 1) {
+      const unsigned char* img = &image_rows[(r & 3) * ncols];
+      const unsigned char* above = &line_rows[((r - 1) & 3) * ncols];
+      const unsigned char* line = &line_rows[(r & 3) * ncols];
+      const unsigned char* below = &line_rows[((r + 1) & 3) * ncols];
+      unsigned char* quest = &question_rows[(r & 3) * ncols];
+      for (int c = 0; c != ncols; ++c)
+        if (img[c] && !line[c] && (below[c] || above[c]))
+          quest[c] = 1;
     }
-  }
 
-  // Questionable rule #2: if it is above or below another questionable pixel
-  for (size_t r = 1; r != image.nrows() - 1; ++r) {
-    for (size_t c = 0; c != image.ncols(); ++c) {
-      if (is_black(image.get(Point(c, r)))) {
-	if (is_black(question.get(Point(c, r - 1))) && is_black(question.get(Point(c, r + 1))))
-	  question.set(Point(c, r), black(question));
+    r = k - 2;
+    if (r >= 1 && r < nrows - 1) {
+      const unsigned char* img_above = &image_rows[((r - 1) & 3) * ncols];
+      const unsigned char* img = &image_rows[(r & 3) * ncols];
+      const unsigned char* img_below = &image_rows[((r + 1) & 3) * ncols];
+      const unsigned char* above = &line_rows[((r - 1) & 3) * ncols];
+      unsigned char* line = &line_rows[(r & 3) * ncols];
+      const unsigned char* below = &line_rows[((r + 1) & 3) * ncols];
+      const unsigned char* quest_above = &question_rows[((r - 1) & 3) * ncols];
+      unsigned char* quest = &question_rows[(r & 3) * ncols];
+      const unsigned char* quest_below = &question_rows[((r + 1) & 3) * ncols];
+
+      // Questionable rule #2: if it is above or below another questionable pixel
+      for (int c = 0; c != ncols; ++c)
+        if (img[c] && quest_above[c] && quest_below[c])
+          quest[c] = 1;
+
+      // Questionable rule #3: a questionable pixel above a line pixel is
+      // relabeled as part of that line if not of the 8-connected pixels
+      // above it are black (pixels beyond the left and right border are white)
+      for (int c = 0; c != ncols; ++c) {
+        if (quest[c] && below[c]) {
+          bool white_above = !img_above[c] &&
+            (c == 0 || !img_above[c - 1]) && (c == ncols - 1 || !img_above[c + 1]);
+          if (white_above)
+            line[c] = 1;
+        }
       }
-    }
-  }
 
-  // Questionable rule #3: a questionable pixel above a line pixel is
-  // relabeled as part of that line if not of the 8-connected pixels
-  // above it are black
-  for (size_t r = 1; r != image.nrows() - 1; ++r) {
-    for (size_t c = 0; c != image.ncols(); ++c) {
-      if (is_black(question.get(Point(c, r))) && is_black(lines.get(Point(c, r + 1)))) {
-	if (is_white(image.get(Point(c - 1, r - 1))) &&
-	    is_white(image.get(Point(c, r - 1))) &&
-	    is_white(image.get(Point(c + 1, r - 1))))
-	  lines.set(Point(c, r), black(question));
+      // Questionable rule #4: a questionable pixel below a line pixel is
+      // relabeled as part of that line if not of the 8-connected pixels
+      // below it are black
+      for (int c = 0; c != ncols; ++c) {
+        if (quest[c] && above[c]) {
+          bool white_below = !img_below[c] &&
+            (c == 0 || !img_below[c - 1]) && (c == ncols - 1 || !img_below[c + 1]);
+          if (white_below)
+            line[c] = 1;
+        }
       }
     }
-  }
 
-  // Questionable rule #4: a questionable pixel below a line pixel is
-  // relabeled as part of that line if not of the 8-connected pixels
-  // below it are black
-  for (size_t r = 1; r != image.nrows() - 1; ++r) {
-    for (size_t c = 0; c != image.ncols(); ++c) {
-      if (is_black(question.get(Point(c, r))) && is_black(lines.get(Point(c, r - 1)))) {
-	if (is_white(image.get(Point(c - 1, r + 1))) &&
-	    is_white(image.get(Point(c, r + 1))) &&
-	    is_white(image.get(Point(c + 1, r + 1))))
-	  lines.set(Point(c, r), black(question));
+    // row r is final now
+    if (r >= 0 && r < nrows) {
+      const unsigned char* line = &line_rows[(r & 3) * ncols];
+      const unsigned char* quest = &question_rows[(r & 3) * ncols];
+      typename V::row_iterator lines_row = lines.row_begin() + r;
+      typename V::row_iterator::iterator l = lines_row.begin();
+      typename V::row_iterator question_row = question.row_begin() + r;
+      typename V::row_iterator::iterator q = question_row.begin();
+      for (int c = 0; c != ncols; ++c, ++l, ++q) {
+        if (line[c])
+          *l = black(lines);
+        if (quest[c])
+          *q = black(question);
       }
     }
   }
@@ -28,10 +28,13 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
+#include <limits.h>
 #include <math.h>
 
 #include "gamera.hpp"
 #include "plugins/image_utilities.hpp"
+#include "musicstaves_parallel.hpp"
 
 //#define CDEBUG(x) do {cerr x; fflush(stderr);} while (0) //cerr x;
 #define CDEBUG(x) do; while (0) //cerr x;
@@ -71,6 +74,49 @@ struct path_window_t {
 // directions for height measurement
 enum {DIRECTION_UP, DIRECTION_DOWN, DIRECTION_BOTH};
 
+// bits per word of the bit packed rows of kt_handle_all_packed
+#define KT_WORD_BITS (sizeof(unsigned long) * 8)
+
+/*
+ * the paths of a path window in a flat layout, in which the common
+ * prefixes of the paths are stored only once (i.e. a prefix tree). the
+ * pixel i (relative to (0,0) as in path_t) follows the pixel 'parent[i]'
+ * on its paths (-1 for the first pixels), and path p consists of the
+ * pixels 'path_pixels[j]' for path_begin[p] <= j < path_begin[p+1]. the
+ * pixels are numbered in depth first order, so that the pixels following
+ * pixel i on any path are i+1 ... subtree_end[i]-1.
+ */
+struct path_set_t {
+  vector<int> x, y, parent, subtree_end;
+  vector<int> path_begin, path_pixels;
+
+  int max_dx;    // largest horizontal offset of a pixel
+  int min_reach; // smallest height of the last pixel of a path
+  bool rising;   // the heights of all paths are >= 0 and never decrease
+};
+
+/*
+ * the paths that make_paths computes for one set of arguments
+ */
+struct path_cache_entry_t {
+  struct path_window_t window;
+  struct path_set_t set;
+};
+
+/*
+ * process wide cache of the path windows, keyed by the arguments of
+ * make_paths. it is only accessed from the plugin functions, i.e. with
+ * Python's global interpreter lock held.
+ */
+typedef pair<int, pair<double, double> > path_key_t;
+struct path_cache_t {
+  map<path_key_t, struct path_cache_entry_t*> entries;
+  unsigned long hits, misses;
+};
+
+// the cache is emptied when it would hold more windows
+#define KT_PATH_CACHE_SIZE 64
+
 /*
  * prototype declarations
  */
@@ -95,6 +141,19 @@ static void kt_handle_points(T&, typename ImageFactory<T>::view_type&,
 template<class T>
 static void kt_handle_all(T&, typename ImageFactory<T>::view_type&,
                           vector<struct path_t>&, int);
+template<class T>
+static void kt_handle_all_packed(T&, typename ImageFactory<T>::view_type&,
+                                 const struct path_set_t&, int, int);
+
+// the cached paths and their flat layout
+static struct path_cache_t& kt_path_cache();
+static const struct path_cache_entry_t& kt_cached_paths(int, double, double);
+static void kt_compile_path_set(const vector<struct path_t>&,
+                                struct path_set_t&);
+PyObject* skewed_runs_cache_statistics();
+void skewed_runs_cache_clear();
+static unsigned long kt_row_bits(const vector<unsigned long>&, size_t, long,
+                                 long, long);
 
 // small inline functions for testing pixels
 template<class T>
@@ -114,14 +173,14 @@ template<class T>
 typename ImageFactory<T>::view_type* 
 keep_tall_skewed_runs(T& image,
                       double l_angle, double r_angle, int height,
-                      PointVector* points, char* directionstr)
+                      PointVector* points, char* directionstr,
+                      int n_threads)
 {
   typedef typename ImageFactory<T>::data_type data_t;
   typedef typename ImageFactory<T>::view_type view_t;
   int direction;
 
   vector<struct path_t> paths;
-  struct path_window_t window;
 
   // image objects
   data_t* dest=new data_t(image.size(), Point(image.offset_x(),
@@ -148,18 +207,21 @@ keep_tall_skewed_runs(T& image,
   l_angle=(90-l_angle)*M_PI/180;
   r_angle=(90-r_angle)*M_PI/180;
 
-  CDEBUG(<< "before make_paths\n");
   // height+1 because of "<" instead of "<=" tests in make_paths
-  window=make_paths(2*(height+1), l_angle, r_angle);
-  CDEBUG(<< "after make_paths\n");
-  paths=window.path_list;
+  const struct path_cache_entry_t& cached=
+    kt_cached_paths(2*(height+1), l_angle, r_angle);
 
   // scan the columns of the rows specified in the vector 'y_list'.
   // if 'y_list' is empty, *all* rows will be scanned instead.
-  if (points->size())
+  if (points->size()) {
+    paths=cached.window.path_list;
     kt_handle_points(image, *dest_view, paths, *points, height, direction);
-  else
+  } else if (cached.set.rising && cached.set.min_reach >= 2*height) {
+    kt_handle_all_packed(image, *dest_view, cached.set, 2*height, n_threads);
+  } else {
+    paths=cached.window.path_list;
     kt_handle_all(image, *dest_view, paths, height);
+  }
 
   return dest_view;
 }
@@ -217,6 +279,297 @@ void kt_handle_all(T& image, typename ImageFactory<T>::view_type& view,
     }
 }
 
+/*****************************************************************************
+ * the same as kt_handle_all, but 64 (i.e. KT_WORD_BITS) pixels of a row
+ * are tested at once on a bit packed copy of the image.
+ *
+ * kt_check_paths accepts a pixel when, for any path, the height reached
+ * by the black pixels of the upper half plus the height reached by the
+ * lower half is at least 'height'. For each half, 'alive[i]' contains the
+ * reference pixels for which pixel i of the prefix tree and all pixels
+ * before it are black; it is the AND of the parent's word and the shifted
+ * row, so that every pixel shared by several paths is tested only once,
+ * and the pixels following an empty word are skipped. The words
+ * 'up[t]' and 'down[t]' of a path are then the alive words of its first
+ * pixel of height t, i.e. the pixels whose half reaches at least height t.
+ * The rows are distributed among 'n_threads' threads.
+ *
+ * the heights of the paths in 'paths' must be rising and reach 'height'.
+ ****************************************************************************/
+template<class T>
+void kt_handle_all_packed(T& image, typename ImageFactory<T>::view_type& view,
+                          const struct path_set_t& paths, int height,
+                          int n_threads)
+{
+  long nrows=image.nrows();
+  long ncols=image.ncols();
+  typename T::value_type black_color=black(view);
+
+  // bit packed rows with at least 'max_dx' white columns on both sides
+  size_t pad_words=(paths.max_dx+KT_WORD_BITS-1)/KT_WORD_BITS;
+  size_t col_words=(ncols+KT_WORD_BITS-1)/KT_WORD_BITS;
+  size_t row_words=col_words+2*pad_words+1;
+  long pad_bits=pad_words*KT_WORD_BITS;
+  vector<unsigned long> rows(nrows*row_words, 0);
+  typename T::row_iterator row_iter=image.row_begin();
+  for (long row=0; row < nrows; row++, row_iter++) {
+    typename T::row_iterator::iterator col_iter=row_iter.begin();
+    for (long col=0; col < ncols; col++, col_iter++)
+      if (is_black(*col_iter)) {
+        size_t b=col+pad_bits;
+        rows[row*row_words+b/KT_WORD_BITS]|=1UL << (b%KT_WORD_BITS);
+      }
+  }
+
+  // the accepted pixels in the same layout
+  vector<unsigned long> result(nrows*row_words, 0);
+
+  // the pixels up to the first one of height 'height' on each path
+  int n=paths.x.size();
+  vector<char> tested(n);
+  for (int i=0; i < n; i++)
+    tested[i]=(paths.parent[i] < 0 || paths.y[paths.parent[i]] < height);
+
+  // the first pixel of height t on path p is levels[p*(height+1)+t]
+  size_t n_paths=paths.path_begin.size()-1;
+  vector<int> levels(n_paths*(height+1), -1);
+  for (size_t p=0; p < n_paths; p++) {
+    int t=1;
+    for (int j=paths.path_begin[p]; j < paths.path_begin[p+1]; j++)
+      for (; t <= paths.y[paths.path_pixels[j]] && t <= height; t++)
+        levels[p*(height+1)+t]=paths.path_pixels[j];
+  }
+
+  n_threads=musicstaves_num_threads(n_threads);
+#pragma omp parallel num_threads(n_threads)
+  {
+    vector<unsigned long> up(height+1), down(height+1);
+    vector<unsigned long> alive_up(n), alive_down(n);
+    // the words of pixel i are valid when 'visited[i]' is the current block
+    vector<unsigned long> visited_up(n, 0), visited_down(n, 0);
+    unsigned long block=0;
+
+#pragma omp for schedule(dynamic, 4)
+    for (long row=0; row < nrows; row++) {
+      for (size_t w=0; w < col_words; w++) {
+        long col=pad_bits+w*KT_WORD_BITS;
+        unsigned long center=rows[row*row_words+pad_words+w];
+        unsigned long found=0;
+
+        if (!center)
+          continue;
+        block++;
+
+        for (int half=0; half < 2; half++) {
+          vector<unsigned long>& alive=(half == 0) ? alive_up : alive_down;
+          vector<unsigned long>& visited=(half == 0) ? visited_up :
+            visited_down;
+          int sign=(half == 0) ? 1 : -1;
+          for (int i=0; i < n; ) {
+            if (!tested[i]) {
+              i=paths.subtree_end[i];
+              continue;
+            }
+            unsigned long a=kt_row_bits(rows, row_words, nrows,
+                                        row-sign*paths.y[i],
+                                        col+sign*paths.x[i]);
+            a&=(paths.parent[i] < 0) ? center : alive[paths.parent[i]];
+            alive[i]=a;
+            visited[i]=block;
+            // the pixels following an empty word stay empty
+            i=a ? i+1 : paths.subtree_end[i];
+          }
+        }
+
+        for (size_t p=0; p < n_paths && found != center; p++) {
+          const int* level=&levels[p*(height+1)];
+          int reach[2];
+          for (int half=0; half < 2; half++) {
+            vector<unsigned long>& reached=(half == 0) ? up : down;
+            vector<unsigned long>& alive=(half == 0) ? alive_up : alive_down;
+            vector<unsigned long>& visited=(half == 0) ? visited_up :
+            visited_down;
+            reached[0]=center;
+            // the largest height reached by any of the pixels
+            reach[half]=0;
+            for (int t=1; t <= height && visited[level[t]] == block &&
+                   alive[level[t]]; t++) {
+              reached[t]=alive[level[t]];
+              reach[half]=t;
+            }
+          }
+          for (int t=max(0, height-reach[1]); t <= reach[0]; t++)
+            found|=up[t] & down[height-t];
+        }
+        result[row*row_words+pad_words+w]=found & center;
+      }
+    }
+  }
+
+  // write the result serially, as the view may be run length encoded
+  for (long row=0; row < nrows; row++)
+    for (size_t w=0; w < col_words; w++) {
+      unsigned long bits=result[row*row_words+pad_words+w];
+      for (size_t i=0; bits; i++, bits>>=1)
+        if (bits & 1)
+          view.set(Point(w*KT_WORD_BITS+i, row), black_color);
+    }
+}
+
+/*****************************************************************************
+ * the process wide cache of kt_cached_paths
+ ****************************************************************************/
+struct path_cache_t& kt_path_cache()
+{
+  static struct path_cache_t cache;
+  return cache;
+}
+
+/*****************************************************************************
+ * returns the paths of make_paths(height, l_angle, r_angle), which are
+ * computed only when they are not in the cache yet.
+ ****************************************************************************/
+const struct path_cache_entry_t& kt_cached_paths(int height, double l_angle,
+                                                 double r_angle)
+{
+  struct path_cache_t& cache=kt_path_cache();
+  path_key_t key(height, make_pair(l_angle, r_angle));
+  map<path_key_t, struct path_cache_entry_t*>::iterator i=
+    cache.entries.find(key);
+  if (i != cache.entries.end()) {
+    cache.hits++;
+    return *i->second;
+  }
+
+  cache.misses++;
+  if (cache.entries.size() >= KT_PATH_CACHE_SIZE)
+    skewed_runs_cache_clear();
+  struct path_cache_entry_t* entry=new struct path_cache_entry_t;
+  entry->window=make_paths(height, l_angle, r_angle);
+  kt_compile_path_set(entry->window.path_list, entry->set);
+  cache.entries[key]=entry;
+  return *entry;
+}
+
+/*****************************************************************************
+ * stores 'paths' in the flat layout 'set'. the pixels are numbered in the
+ * order of their first occurrence, so that the pixels of a path have
+ * increasing numbers.
+ ****************************************************************************/
+void kt_compile_path_set(const vector<struct path_t>& paths,
+                         struct path_set_t& set)
+{
+  vector<struct path_t>::const_iterator path_iter;
+  vector<struct pixel_t>::const_iterator pix_iter;
+  map<pair<int, pair<int, int> >, int> known;
+
+  set.max_dx=0;
+  set.min_reach=INT_MAX;
+  set.rising=true;
+  for (path_iter=paths.begin(); path_iter != paths.end(); path_iter++) {
+    int parent=-1;
+    int last_y=0;
+    set.path_begin.push_back(set.path_pixels.size());
+    for (pix_iter=path_iter->pixel_list.begin();
+         pix_iter != path_iter->pixel_list.end(); pix_iter++) {
+      pair<int, pair<int, int> > node(parent,
+                                      make_pair(pix_iter->x, pix_iter->y));
+      map<pair<int, pair<int, int> >, int>::iterator i=known.find(node);
+      if (i == known.end()) {
+        i=known.insert(make_pair(node, int(set.x.size()))).first;
+        set.x.push_back(pix_iter->x);
+        set.y.push_back(pix_iter->y);
+        set.parent.push_back(parent);
+      }
+      parent=i->second;
+      set.path_pixels.push_back(parent);
+
+      set.max_dx=max(set.max_dx, abs(pix_iter->x));
+      if (pix_iter->y < last_y)
+        set.rising=false;
+      last_y=pix_iter->y;
+    }
+    set.min_reach=min(set.min_reach, last_y);
+  }
+  set.path_begin.push_back(set.path_pixels.size());
+
+  // renumber the pixels in depth first order
+  int n=set.x.size();
+  vector<vector<int> > children(n+1);
+  for (int i=0; i < n; i++)
+    children[set.parent[i] < 0 ? n : set.parent[i]].push_back(i);
+  vector<int> order, stack(children[n].rbegin(), children[n].rend());
+  while (!stack.empty()) {
+    int i=stack.back();
+    stack.pop_back();
+    order.push_back(i);
+    stack.insert(stack.end(), children[i].rbegin(), children[i].rend());
+  }
+  vector<int> number(n);
+  for (int k=0; k < n; k++)
+    number[order[k]]=k;
+
+  struct path_set_t sorted=set;
+  for (int k=0; k < n; k++) {
+    int i=order[k];
+    sorted.x[k]=set.x[i];
+    sorted.y[k]=set.y[i];
+    sorted.parent[k]=(set.parent[i] < 0) ? -1 : number[set.parent[i]];
+  }
+  for (size_t j=0; j < set.path_pixels.size(); j++)
+    sorted.path_pixels[j]=number[set.path_pixels[j]];
+  sorted.subtree_end.resize(n);
+  for (int k=n-1; k >= 0; k--) {
+    int end=k+1;
+    for (size_t c=0; c < children[order[k]].size(); c++)
+      end=max(end, sorted.subtree_end[number[children[order[k]][c]]]);
+    sorted.subtree_end[k]=end;
+  }
+  set=sorted;
+}
+
+/*****************************************************************************
+ * the statistics of the cache of kt_cached_paths for the plugin
+ * skewed_runs_cache_statistics.
+ ****************************************************************************/
+PyObject* skewed_runs_cache_statistics()
+{
+  struct path_cache_t& cache=kt_path_cache();
+  return Py_BuildValue("{s:k,s:k,s:k}",
+                       "hits", cache.hits,
+                       "misses", cache.misses,
+                       "entries", (unsigned long)cache.entries.size());
+}
+
+/*****************************************************************************
+ * removes all paths from the cache of kt_cached_paths. the hit and miss
+ * counts are kept.
+ ****************************************************************************/
+void skewed_runs_cache_clear()
+{
+  struct path_cache_t& cache=kt_path_cache();
+  map<path_key_t, struct path_cache_entry_t*>::iterator i;
+  for (i=cache.entries.begin(); i != cache.entries.end(); i++)
+    delete i->second;
+  cache.entries.clear();
+}
+
+/*****************************************************************************
+ * the KT_WORD_BITS pixels of row 'row' from bit 'bit' of the bit packed
+ * 'rows' on; rows outside of the image are white.
+ ****************************************************************************/
+unsigned long kt_row_bits(const vector<unsigned long>& rows, size_t row_words,
+                          long nrows, long row, long bit)
+{
+  if (row < 0 || row >= nrows)
+    return 0;
+  const unsigned long* words=&rows[row*row_words+bit/KT_WORD_BITS];
+  size_t shift=bit%KT_WORD_BITS;
+  if (shift == 0)
+    return words[0];
+  return (words[0] >> shift) | (words[1] << (KT_WORD_BITS-shift));
+}
+
 /*****************************************************************************
  * keep_tall_skewed_runs: kt_mark_paths
  *
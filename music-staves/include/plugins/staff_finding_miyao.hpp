@@ -19,79 +19,277 @@
 #ifndef STAFF_FINDING_MIYAO_2005
 #define STAFF_FINDING_MIYAO_2005
 
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 #include "gamera.hpp"
+#include "musicstaves_parallel.hpp"
 
 using namespace Gamera;
 
+// Finds the candidate points of all scanlines (see miyao_candidate_points)
+// and returns them in a flat buffer: for scan_line_count = n, the values
+// 0 ... n-1 are the x positions of the scanlines, the values n ... 2n are
+// offsets into the buffer, and the y positions of the candidate points of
+// scanline k are at the offsets buffer[n+k] ... buffer[n+k+1]-1.
+// The image is read row by row, each row only at the scanline columns. The
+// scanlines are split into *n_threads* groups that are scanned concurrently.
+template<class T>
+IntVector *miyao_candidate_points_flat(const T &m,
+                                       unsigned int scan_line_count,
+                                       unsigned int tolerance,
+                                       unsigned int staff_line_height,
+                                       int n_threads = 1)
+{
+  size_t scan_line, row, n;
+  double scan_pos_factor;
+
+  n = scan_line_count;
+  scan_pos_factor = (double) m.ncols() / (scan_line_count + 1);
+  std::vector<size_t> columns(n);
+  for (scan_line = 1; scan_line <= n; scan_line++)
+    columns[scan_line - 1] = (size_t) (scan_line * scan_pos_factor);
+
+  std::vector<IntVector> candidates(n);
+  int n_groups = std::max(1, std::min(musicstaves_num_threads(n_threads), int(n)));
+
+#pragma omp parallel for num_threads(n_groups) schedule(static)
+  for (int group = 0; group < n_groups; group++) {
+    size_t first = n * group / n_groups;
+    size_t last = n * (group + 1) / n_groups;
+    std::vector<size_t> black_count(last - first, 0);
+    typename T::const_row_iterator r = m.row_begin();
+    for (row = 0; row < m.nrows(); row++, r++) {
+      typename T::const_row_iterator::iterator begin = r.begin();
+      for (size_t k = first; k < last; k++) {
+        size_t& count = black_count[k - first];
+        if (is_black(*(begin + columns[k]))) {
+          count++;
+        }
+        else // pixel not black => evaluate counter
+        {
+          // black runlength within tolerance?
+          if (count > 0 &&
+              count >= staff_line_height - tolerance &&
+              count <= staff_line_height + tolerance)
+            candidates[k].push_back(int(row - count / 2 - 1));
+          count = 0;
+        }
+      }
+    }
+  }
+
+  IntVector *result = new IntVector(2 * n + 1);
+  for (scan_line = 0; scan_line < n; scan_line++) {
+    (*result)[scan_line] = int(columns[scan_line]);
+    (*result)[n + scan_line] = int(result->size());
+    result->insert(result->end(), candidates[scan_line].begin(),
+                   candidates[scan_line].end());
+  }
+  (*result)[2 * n] = int(result->size());
+  return result;
+}
+
 template<class T>
 PyObject *miyao_candidate_points(const T &m,
                                unsigned int scan_line_count,
                                unsigned int tolerance,
                                unsigned int staff_line_height)
 {
-  size_t scan_line, row, column, black_count, cp_row;
-  double scan_pos_factor;
+  size_t scan_line, i, n;
   PyObject* pyobj; // helper variable
 
-  PyObject *return_list = PyList_New(0);
-
-  scan_pos_factor = (double) m.ncols() / (scan_line_count + 1);
+  IntVector *flat = miyao_candidate_points_flat(m, scan_line_count, tolerance,
+                                                staff_line_height);
+  n = scan_line_count;
 
-  for (scan_line = 1; scan_line <= scan_line_count; scan_line++)
+  PyObject *return_list = PyList_New(n);
+  for (scan_line = 0; scan_line < n; scan_line++)
   {
-    column = (size_t) (scan_line * scan_pos_factor);
-    black_count = 0;
-
-    PyObject *scan_line_list = PyList_New(0);
+    size_t begin = (*flat)[n + scan_line], end = (*flat)[n + scan_line + 1];
+    PyObject *scan_line_list = PyList_New(end - begin + 1);
 
     // mark column in list
-    pyobj = PyLong_FromUnsignedLong(column);
-    PyList_Append(scan_line_list, pyobj);
-    Py_DECREF(pyobj);
-
-    for (row = 0; row < m.nrows(); row++)
-    {
-      if (is_black(m.get(Point(column, row))))
-      {
-        black_count++;
-      }
-      else // pixel not black => evaluate counter
-      {
-        
-        // black runlength within tolerance?
-        if (black_count > 0 &&
-            black_count >= staff_line_height - tolerance &&
-            black_count <= staff_line_height + tolerance)
-          {
-            // yes: determine coordinates and mark in list
-            cp_row = row - black_count / 2 - 1;
-            pyobj = PyLong_FromUnsignedLong(cp_row);
-            PyList_Append(scan_line_list, pyobj);
-            Py_DECREF(pyobj);
-          }
-
-        black_count = 0;
-      }
-    }
+    pyobj = PyLong_FromUnsignedLong((*flat)[scan_line]);
+    PyList_SET_ITEM(scan_line_list, 0, pyobj);
 
     // add candidate points to list
-    PyList_Append(return_list, scan_line_list);
-    Py_DECREF(scan_line_list);
+    for (i = begin; i < end; i++) {
+      pyobj = PyLong_FromUnsignedLong((*flat)[i]);
+      PyList_SET_ITEM(scan_line_list, i - begin + 1, pyobj);
+    }
+
+    PyList_SET_ITEM(return_list, scan_line, scan_line_list);
   }
+  delete flat;
 
   return return_list;
 }
 
 
+// Answers the pixel tests of miyao_distance and miyao_find_edge on bit
+// packed, vertically pooled rows of (a column range of) the image: bit x of
+// the "any" row y is set when one of the pixels (x,y-1), (x,y), (x,y+1) is
+// black, and bit x of the "all" row y when all three are black. The number
+// of set bits in a row segment is found with per-word prefix counts, so that
+// the blackness of a line costs one lookup per row the line passes instead
+// of three pixel reads per column.
+// The rows are computed when they are first needed and then kept, so that
+// the pixels of a row are read only once for all lines through it. Pixels
+// outside the image or the column range count as white.
+// An oracle must not be used by two threads at the same time.
 template<class T>
-int miyao_distance(T &img, int xa, int ya, int xb, int yb,
-                    float blackness, float pr_angle, int penalty)
+class MiyaoLineOracle {
+public:
+  typedef unsigned long word_type;
+  enum { word_bits = sizeof(word_type) * 8 };
+
+  // the columns [x0, x1) of *image* (x1 == 0 means up to the right border)
+  MiyaoLineOracle(const T &image, size_t x0 = 0, size_t x1 = 0)
+    : m_image(image), m_x0(x0), m_x1(x1 == 0 ? image.ncols() : x1),
+      m_nrows(image.nrows()),
+      m_words((m_x1 - m_x0 + word_bits - 1) / word_bits),
+      m_pixels(m_nrows), m_any(m_nrows + 2), m_all(m_nrows + 2),
+      m_any_prefix(m_nrows + 2) {}
+
+  size_t nrows() const { return m_nrows; }
+  size_t ncols() const { return m_image.ncols(); }
+
+  bool any(int x, int y) { return test(x, y, m_any); }
+  bool all(int x, int y) { return test(x, y, m_all); }
+
+  // number of columns x in [xbegin, xend) for which any(x, y) holds
+  size_t count_any(int y, int xbegin, int xend) {
+    xbegin = std::max(xbegin, int(m_x0));
+    xend = std::min(xend, int(m_x1));
+    if (xbegin >= xend || y < -1 || y > int(m_nrows))
+      return 0;
+    make_row(y);
+    const std::vector<word_type>& row = m_any[y + 1];
+    const std::vector<unsigned int>& prefix = m_any_prefix[y + 1];
+    size_t b = xbegin - m_x0, e = xend - m_x0;
+    size_t wb = b / word_bits, we = e / word_bits;
+    size_t count = prefix[we] - prefix[wb];
+    count -= popcount(row[wb] & ((word_type(1) << (b % word_bits)) - 1));
+    if (e % word_bits)
+      count += popcount(row[we] & ((word_type(1) << (e % word_bits)) - 1));
+    return count;
+  }
+
+  // The number of columns x in [xa, xb) for which any(x, y(x)) holds, where
+  // y(x) follows the line from (xa, ya) with slope *mm*, rounded exactly as
+  // in miyao_distance.
+  size_t line_blackness(int xa, int ya, int xb, double mm) {
+    size_t blacksum = 0;
+    double dy = 0.0;
+    int x = xa;
+    while (x < xb) {
+      int y = ya + int(dy + 0.5);
+      int start = x;
+      do {
+        dy += mm;
+        x++;
+      } while (x < xb && ya + int(dy + 0.5) == y);
+      blacksum += count_any(y, start, x);
+    }
+    return blacksum;
+  }
+
+private:
+  static size_t popcount(word_type w) {
+#ifdef __GNUC__
+    return __builtin_popcountl(w);
+#else
+    size_t n = 0;
+    for (; w; w &= w - 1)
+      n++;
+    return n;
+#endif
+  }
+
+  bool test(int x, int y, std::vector<std::vector<word_type> >& rows) {
+    if (x < int(m_x0) || x >= int(m_x1) || y < -1 || y > int(m_nrows))
+      return false;
+    make_row(y);
+    size_t b = x - m_x0;
+    return (rows[y + 1][b / word_bits] >> (b % word_bits)) & 1;
+  }
+
+  // packs the pixels of image row y
+  const std::vector<word_type>& pixel_row(int y) {
+    std::vector<word_type>& bits = m_pixels[y];
+    if (bits.empty()) {
+      bits.resize(m_words + 1, 0);
+      typename T::const_row_iterator r = m_image.row_begin() + y;
+      typename T::const_row_iterator::iterator p = r.begin() + m_x0;
+      for (size_t b = 0; b < m_x1 - m_x0; b++, p++)
+        if (is_black(*p))
+          bits[b / word_bits] |= word_type(1) << (b % word_bits);
+    }
+    return bits;
+  }
+
+  // computes the pooled rows y (-1 <= y <= nrows) and their prefix counts
+  void make_row(int y) {
+    std::vector<word_type>& any_row = m_any[y + 1];
+    if (!any_row.empty())
+      return;
+    std::vector<word_type>& all_row = m_all[y + 1];
+    any_row.assign(m_words + 1, 0);
+    all_row.assign(m_words + 1, ~word_type(0));
+    for (int yy = y - 1; yy <= y + 1; yy++) {
+      if (yy < 0 || yy >= int(m_nrows)) {
+        all_row.assign(m_words + 1, 0);
+        continue;
+      }
+      const std::vector<word_type>& bits = pixel_row(yy);
+      for (size_t w = 0; w <= m_words; w++) {
+        any_row[w] |= bits[w];
+        all_row[w] &= bits[w];
+      }
+    }
+    std::vector<unsigned int>& prefix = m_any_prefix[y + 1];
+    prefix.resize(m_words + 2);
+    prefix[0] = 0;
+    for (size_t w = 0; w <= m_words; w++)
+      prefix[w + 1] = prefix[w] + popcount(any_row[w]);
+  }
+
+  const T &m_image;
+  size_t m_x0, m_x1, m_nrows, m_words;
+  // (each row has one spare word, so that segments may end at m_x1)
+  std::vector<std::vector<word_type> > m_pixels, m_any, m_all;
+  std::vector<std::vector<unsigned int> > m_any_prefix;
+};
+
+
+// Miyao's angle criterium for the link from a to b (xa < xb), see
+// miyao_distance. Returns the slope of the link in *mm*.
+inline bool miyao_angle_ok(int xa, int ya, int xb, int yb, float pr_angle,
+                           double &mm)
 {
   // some constants
   float onedegree = 0.017453;  // one degree in radian
   float twentydegree = 0.34907; // twenty degree in radian
   float pihalf = 1.5708; // pi / 2
   float angle;
+
+  mm = double(yb-ya) / double(xb-xa);
+  angle = atan(mm);
+  if (abs(pr_angle) >= pihalf) {
+    if (abs(angle) > twentydegree)
+      return false;
+  } else {
+    if (abs(pr_angle - angle) > onedegree)
+      return false;
+  }
+  return true;
+}
+
+template<class T>
+int miyao_distance(T &img, int xa, int ya, int xb, int yb,
+                    float blackness, float pr_angle, int penalty)
+{
   double dy, mm;
   int y;
   size_t blacksum = 0;
@@ -104,15 +302,8 @@ int miyao_distance(T &img, int xa, int ya, int xb, int yb,
   }
 
   // first criterium: check angle
-  mm = double(yb-ya) / double(xb-xa);
-  angle = atan(mm);
-  if (abs(pr_angle) >= pihalf) {
-    if (abs(angle) > twentydegree)
-      return penalty;
-  } else {
-    if (abs(pr_angle - angle) > onedegree)
-      return penalty;
-  }
+  if (!miyao_angle_ok(xa, ya, xb, yb, pr_angle, mm))
+    return penalty;
 
   // second criterium: blackness along line
   dy = 0.0;
@@ -132,6 +323,87 @@ int miyao_distance(T &img, int xa, int ya, int xb, int yb,
 
 }
 
+// The same as miyao_distance, but the blackness is taken from *oracle*
+template<class T>
+int miyao_distance(MiyaoLineOracle<T> &oracle, int xa, int ya, int xb, int yb,
+                   float blackness, float pr_angle, int penalty)
+{
+  double mm;
+
+  // make sure a is left from b
+  if (xa > xb) {
+    std::swap(xa, xb);
+    std::swap(ya, yb);
+  }
+
+  if (!miyao_angle_ok(xa, ya, xb, yb, pr_angle, mm))
+    return penalty;
+
+  size_t blacksum = oracle.line_blackness(xa, ya, xb, mm);
+  if (blacksum * 1.0 / (xb-xa) < blackness)
+    return penalty;
+
+  return 0;
+}
+
+// Connects the anchor points *ys1* on column *col1* with the anchor points
+// *ys2* on column *col2* with Miyao's DP matching. The distance matrix
+// (distances computed with miyao_distance) and the minimum edit distance
+// matrix are kept in flat arrays of size (len(ys1)+1)*(len(ys2)+1).
+// Returns the matched pairs as [i0, j0, i1, j1, ...] (indices into ys1
+// and ys2) in backtracing order, i.e. from the last anchors to the first.
+template<class T>
+IntVector* miyao_match_anchors(T &img, int col1, IntVector* ys1, int col2,
+                               IntVector* ys2, float blackness, float pr_angle,
+                               int penalty)
+{
+  size_t I = ys1->size() + 1;
+  size_t J = ys2->size() + 1;
+  size_t i, j;
+  std::vector<int> g(I * J), distance(I * J, -1);
+  // all links lie between the two columns
+  MiyaoLineOracle<T> oracle(img, std::min(col1, col2), std::max(col1, col2));
+
+  // initialize matrix
+  for (i = 0; i < I; i++)
+    g[i * J] = i;
+  for (j = 0; j < J; j++)
+    g[j] = j;
+
+  // fill matrix successively
+  for (i = 1; i < I; i++) {
+    for (j = 1; j < J; j++) {
+      int d = miyao_distance(oracle, col1, (*ys1)[i-1], col2, (*ys2)[j-1],
+                             blackness, pr_angle, penalty);
+      g[i*J + j] = std::min(g[(i-1)*J + j-1] + d,
+                            std::min(g[(i-1)*J + j], g[i*J + j-1]) + 1);
+      distance[i*J + j] = d;
+    }
+  }
+
+  // backtrace matches
+  IntVector* links = new IntVector();
+  i = I - 1; j = J - 1;
+  while ((i > 0) && (j > 0)) {
+    int value = g[i*J + j];
+    if (value - distance[i*J + j] == g[(i-1)*J + j-1]) {
+      links->push_back(i - 1);
+      links->push_back(j - 1);
+      i--; j--;
+    }
+    else if (value - 1 == g[(i-1)*J + j])
+      i--;
+    else if (value - 1 == g[i*J + j-1])
+      j--;
+    else {
+      delete links;
+      throw std::runtime_error("Error in backtracing distance matrix");
+    }
+  }
+
+  return links;
+}
+
 template<class T>
 IntVector* miyao_find_edge(T &img, int x, int y, float angle,
                            bool leftdirection)
@@ -187,4 +459,64 @@ IntVector* miyao_find_edge(T &img, int x, int y, float angle,
   return edgepoint;
 }
 
+// The same as miyao_find_edge, but the pixels are tested with *oracle*,
+// which must cover all columns of the image, and the edge point is
+// returned in (*ex*, *ey*)
+template<class T>
+void miyao_trace_edge(MiyaoLineOracle<T> &oracle, int x, int y, float angle,
+                      bool leftdirection, int &ex, int &ey)
+{
+  int xx, yy;
+  int nrows = oracle.nrows(), ncols = oracle.ncols();
+  int direction = leftdirection ? -1 : +1;
+  double dy = 0.0, mm = tan(angle);
+
+  xx = x;
+  yy = y;
+  // when pixel black, scan until white pixel is found
+  if (oracle.any(xx, yy)) {
+    do {
+      xx += direction;
+      dy += direction * mm;
+      yy = y + int(dy + 0.5);
+    } while ((xx > 0) && (xx+1 < ncols) && (yy > 0) && (yy+1 < nrows) &&
+             oracle.any(xx, yy));
+    ex = xx - direction;
+    ey = yy + int(dy - (direction * mm) + 0.5);
+  }
+  // otherwise scan in opposite direction until black pixel is found
+  else {
+    do {
+      xx -= direction;
+      dy -= direction * mm;
+      yy = y + int(dy + 0.5);
+    } while ((xx > 0) && (xx+1 < ncols) && (yy > 0) && (yy+1 < nrows) &&
+             !oracle.all(xx, yy));
+    ex = xx + direction;
+    ey = yy + int(dy + (direction * mm) + 0.5);
+  }
+}
+
+// Looks for the edge points of many points at once, like miyao_find_edge
+// does for the point (xs[i], ys[i]) with angles[i] and leftdirections[i].
+// The rows visited by one trace are kept for all following ones.
+// Returns the edge points as a flat list [x0, y0, x1, y1, ...].
+template<class T>
+IntVector* miyao_find_edges(T &img, IntVector* xs, IntVector* ys,
+                            FloatVector* angles, IntVector* leftdirections)
+{
+  size_t n = xs->size();
+  if (ys->size() != n || angles->size() != n || leftdirections->size() != n)
+    throw std::runtime_error("miyao_find_edges: xs, ys, angles and "
+                             "leftdirections must have the same length");
+
+  MiyaoLineOracle<T> oracle(img);
+  IntVector* edgepoints = new IntVector(2 * n, 0);
+  for (size_t i = 0; i < n; i++)
+    miyao_trace_edge(oracle, (*xs)[i], (*ys)[i], float((*angles)[i]),
+                     (*leftdirections)[i] != 0,
+                     (*edgepoints)[2*i], (*edgepoints)[2*i+1]);
+  return edgepoints;
+}
+
 #endif
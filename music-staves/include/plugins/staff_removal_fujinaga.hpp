@@ -21,6 +21,8 @@
 #define mgd01042005_findandremovestaves
 
 #include <math.h> // for tan
+#include <map>
+#include <string>
 
 #include <gamera.hpp>
 #include <plugins/logical.hpp>
@@ -30,6 +32,10 @@
 #include <plugins/projections.hpp>
 #include <plugins/morphology.hpp>
 
+#include "musicstaves_parallel.hpp"
+#include "cross_correlation.hpp"
+#include "column_runs.hpp"
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // DEBUGGING OUTPUT
 
@@ -57,6 +63,8 @@ namespace Aomr {
 
   typedef TypeIdImageFactory<ONEBIT, DENSE>::data_type data_type;
   typedef TypeIdImageFactory<ONEBIT, DENSE>::image_type view_type;
+  typedef TypeIdImageFactory<ONEBIT, RLE>::data_type rle_data_type;
+  typedef TypeIdImageFactory<ONEBIT, RLE>::image_type rle_view_type;
 
   ///////////////////////////////////////////////////////////////////////////////////////////////
   // BASIC DATA STRUCTURES
@@ -85,6 +93,29 @@ namespace Aomr {
     StaffVector staves;
   };
 
+  // Returns the shear distance of column *col* for the given offsets (see deskew).
+  inline int deskew_distance(size_t col, IntVector *offsets, int width, size_t nrows) {
+    IntVector::iterator offset = offsets->begin();
+    double inc;   /* interpolation inc per pixel */
+    int distance; /* offset value after interpolation for the column */
+    size_t index = col / width;
+    // Be careful not to read off the end of offset list
+    if (index >= offsets->size() - 1) {
+      distance = offset[offsets->size() - 1];
+    } else {
+      inc = (offset[index] - offset[index + 1]) / (double)width; /* linear interpolation */
+      distance = (int)::round((col % width) * inc) - offset[index];
+    }
+    // Threshold the distance so we don't over-adjust (beyond the edge of the image).
+    // Frankly, if we're deskewing by that much there's something seriously wrong elsewhere, 
+    // but it's better than crasing <wink>
+    if (distance >= (int)nrows)
+      distance = nrows - 1;
+    else if (distance <= -(int)nrows)
+      distance = -(int)nrows + 1;
+    return distance;
+  }
+
   template<class T> void deskew(T&, IntVector *, int);
   struct DeskewData {
     IntVector offsets;
@@ -101,13 +132,293 @@ namespace Aomr {
     }
   };
 
+  // A ShearField folds a sequence of deskews (stored as DeskewData, in the
+  // order of Param::deskew_data, which is undone from back to front) into a
+  // single mapping from each pixel to the pixel of the original image it
+  // comes from. Pixels stay within their column.
+  //
+  // The mapping can either be queried with source_row, or applied once with
+  // apply, which gives the same result as undoing every deskew one after the
+  // other, but moves every pixel at most once.
+  class ShearField {
+  public:
+    ShearField(const vector<DeskewData>& layers, int width, const Rect& image)
+      : m_layers(layers), m_width(width), m_ul_x(image.ul_x()), m_ul_y(image.ul_y()),
+	m_ncols(image.ncols()), m_nrows(image.nrows()) {
+      // Group neighbouring columns that are sheared identically by all layers
+      IntVector last;
+      for (size_t col = 0; col < m_ncols; ++col) {
+	IntVector current = distances(col);
+	if (col == 0 || current != last) {
+	  m_block_start.push_back(col);
+	  m_block_sheared.push_back(std::count(current.begin(), current.end(), 0)
+				    != (int)current.size());
+	  last = current;
+	}
+      }
+      m_block_start.push_back(m_ncols);
+    }
+
+    // Returns the row (relative to the image) of the original pixel that
+    // ends up at (col, row).
+    size_t source_row(size_t col, size_t row) const {
+      return source_row(distances(col), row);
+    }
+
+    // Undoes all deskews on *image* in place. *image* must have the
+    // dimensions of the image the ShearField has been constructed for.
+    template<class T>
+    void apply(T& image) const {
+      typedef typename T::row_iterator row_iterator;
+      if (image.ncols() != m_ncols || image.nrows() != m_nrows)
+	throw std::range_error("ShearField: image dimensions do not match");
+      vector<size_t> source(m_nrows);
+      row_iterator first = image.row_begin();
+      for (size_t b = 0; b + 1 < m_block_start.size(); ++b) {
+	if (!m_block_sheared[b])
+	  continue;
+	size_t col = m_block_start[b];
+	size_t end = m_block_start[b + 1];
+	IntVector block_distances = distances(col);
+	for (size_t row = 0; row < m_nrows; ++row)
+	  source[row] = source_row(block_distances, row);
+	// source is monotonic, so the rows that move up can be copied top down
+	// and the rows that move down bottom up without overwriting any source
+	for (size_t row = 0; row < m_nrows; ++row) {
+	  if (source[row] > row) {
+	    row_iterator src = first + source[row];
+	    row_iterator dst = first + row;
+	    std::copy(src.begin() + col, src.begin() + end, dst.begin() + col);
+	  }
+	}
+	for (size_t row = m_nrows; row-- > 0; ) {
+	  if (source[row] < row) {
+	    row_iterator src = first + source[row];
+	    row_iterator dst = first + row;
+	    std::copy(src.begin() + col, src.begin() + end, dst.begin() + col);
+	  }
+	}
+      }
+    }
+
+  private:
+    // the shear distance of *layer* in column *col* (0 outside of the layer)
+    int layer_distance(const DeskewData& layer, size_t col) const {
+      if (layer.rect.width() == 0)
+	return deskew_distance(col, const_cast<IntVector*>(&layer.offsets), m_width, m_nrows);
+      size_t x = layer.rect.ul_x() - m_ul_x;
+      if (col < x || col >= x + layer.rect.ncols())
+	return 0;
+      return deskew_distance(col - x, const_cast<IntVector*>(&layer.offsets), m_width,
+			     layer.rect.nrows());
+    }
+
+    // the shear distances of all layers in column *col*
+    IntVector distances(size_t col) const {
+      IntVector result(m_layers.size());
+      for (size_t i = 0; i < m_layers.size(); ++i)
+	result[i] = layer_distance(m_layers[i], col);
+      return result;
+    }
+
+    // follows the pixel at *row* back through all layers, given their
+    // shear distances in its column
+    size_t source_row(const IntVector& distances, size_t row) const {
+      for (size_t i = 0; i < m_layers.size(); ++i) {
+	if (distances[i] == 0)
+	  continue;
+	size_t y = 0, nrows = m_nrows;
+	if (m_layers[i].rect.width() != 0) {
+	  y = m_layers[i].rect.ul_y() - m_ul_y;
+	  nrows = m_layers[i].rect.nrows();
+	  if (row < y || row >= y + nrows)
+	    continue;
+	}
+	int r = int(row - y) - distances[i];
+	if (r < 0)
+	  r = 0;
+	else if (r >= int(nrows))
+	  r = int(nrows) - 1;
+	row = y + r;
+      }
+      return row;
+    }
+
+    vector<DeskewData> m_layers;
+    int m_width;
+    size_t m_ul_x, m_ul_y, m_ncols, m_nrows;
+    // columns [m_block_start[b], m_block_start[b + 1]) are sheared identically
+    vector<size_t> m_block_start;
+    vector<bool> m_block_sheared;
+  };
+
+  // A FujinagaWorkspace holds the page sized temporaries of the pipeline
+  // (filtered copies of the page and the projection buffer of the skew
+  // estimation).  Buffers that are released are kept and handed out again,
+  // so that a workspace that is reused for many pages of the same size does
+  // not allocate anything after the first page.
+  // Images returned to the caller are never taken from the workspace.
+  // A workspace must not be used by two pipelines at the same time.
+  class FujinagaWorkspace {
+  public:
+    FujinagaWorkspace() : allocated_bytes(0), peak_bytes(0), in_use_bytes(0),
+			  allocations(0), reuses(0) {}
+    ~FujinagaWorkspace() {
+      clear();
+    }
+
+    // Returns a white image of the given size at offset (0, 0)
+    data_type* acquire_image(const Dim& dim) {
+      for (size_t i = 0; i < m_free_images.size(); ++i) {
+	data_type* data = m_free_images[i];
+	if (data->ncols() == dim.ncols() && data->nrows() == dim.nrows()) {
+	  m_free_images.erase(m_free_images.begin() + i);
+	  std::fill(data->begin(), data->end(), pixel_traits<OneBitPixel>::white());
+	  in_use_bytes += image_bytes(data);
+	  ++reuses;
+	  return data;
+	}
+      }
+      data_type* data = new data_type(dim, Point(0, 0));
+      in_use_bytes += image_bytes(data);
+      add_allocated(image_bytes(data));
+      return data;
+    }
+    void release_image(data_type* data) {
+      in_use_bytes -= image_bytes(data);
+      m_free_images.push_back(data);
+      trim();
+    }
+
+    // Returns a zero filled vector of the given size
+    IntVector* acquire_vector(size_t size) {
+      for (size_t i = 0; i < m_free_vectors.size(); ++i) {
+	IntVector* vec = m_free_vectors[i];
+	if (vec->capacity() >= size) {
+	  m_free_vectors.erase(m_free_vectors.begin() + i);
+	  vec->assign(size, 0);
+	  in_use_bytes += vector_bytes(vec);
+	  m_in_use_vectors[vec] = vector_bytes(vec);
+	  ++reuses;
+	  return vec;
+	}
+      }
+      IntVector* vec = new IntVector(size, 0);
+      in_use_bytes += vector_bytes(vec);
+      m_in_use_vectors[vec] = vector_bytes(vec);
+      add_allocated(vector_bytes(vec));
+      return vec;
+    }
+    void release_vector(IntVector* vec) {
+      // the vector may have grown while it was in use
+      size_t acquired = m_in_use_vectors[vec];
+      m_in_use_vectors.erase(vec);
+      in_use_bytes -= acquired;
+      if (vector_bytes(vec) > acquired) {
+	allocated_bytes += vector_bytes(vec) - acquired;
+	peak_bytes = std::max(peak_bytes, allocated_bytes);
+      }
+      m_free_vectors.push_back(vec);
+      trim();
+    }
+
+    // Frees all buffers that are not in use
+    void clear() {
+      for (size_t i = 0; i < m_free_images.size(); ++i) {
+	allocated_bytes -= image_bytes(m_free_images[i]);
+	delete m_free_images[i];
+      }
+      m_free_images.clear();
+      for (size_t i = 0; i < m_free_vectors.size(); ++i) {
+	allocated_bytes -= vector_bytes(m_free_vectors[i]);
+	delete m_free_vectors[i];
+      }
+      m_free_vectors.clear();
+    }
+
+    // memory held by the workspace (in use or pooled), its maximum so far,
+    // and the part of it that is currently in use, all in bytes
+    size_t allocated_bytes, peak_bytes, in_use_bytes;
+    // number of buffers that have been newly allocated / reused
+    size_t allocations, reuses;
+
+  private:
+    // never keep more than this many unused buffers of each kind
+    enum { max_free = 8 };
+
+    FujinagaWorkspace(const FujinagaWorkspace&);
+    FujinagaWorkspace& operator=(const FujinagaWorkspace&);
+
+    static size_t image_bytes(data_type* data) {
+      return data->ncols() * data->nrows() * sizeof(OneBitPixel);
+    }
+    static size_t vector_bytes(IntVector* vec) {
+      return vec->capacity() * sizeof(int);
+    }
+    void add_allocated(size_t bytes) {
+      ++allocations;
+      allocated_bytes += bytes;
+      peak_bytes = std::max(peak_bytes, allocated_bytes);
+    }
+    // drops the oldest unused buffers
+    void trim() {
+      while (m_free_images.size() > max_free) {
+	allocated_bytes -= image_bytes(m_free_images.front());
+	delete m_free_images.front();
+	m_free_images.erase(m_free_images.begin());
+      }
+      while (m_free_vectors.size() > max_free) {
+	allocated_bytes -= vector_bytes(m_free_vectors.front());
+	delete m_free_vectors.front();
+	m_free_vectors.erase(m_free_vectors.begin());
+      }
+    }
+
+    vector<data_type*> m_free_images;
+    vector<IntVector*> m_free_vectors;
+    std::map<IntVector*, size_t> m_in_use_vectors;
+  };
+
+  // Borrows an image from a FujinagaWorkspace for the lifetime of the object
+  class WorkspaceImage {
+  public:
+    WorkspaceImage(FujinagaWorkspace& workspace, const Dim& dim)
+      : m_workspace(workspace), m_data(workspace.acquire_image(dim)) {}
+    ~WorkspaceImage() {
+      m_workspace.release_image(m_data);
+    }
+    data_type& data() { return *m_data; }
+  private:
+    WorkspaceImage(const WorkspaceImage&);
+    WorkspaceImage& operator=(const WorkspaceImage&);
+    FujinagaWorkspace& m_workspace;
+    data_type* m_data;
+  };
+
+  // Borrows a vector from a FujinagaWorkspace for the lifetime of the object
+  class WorkspaceVector {
+  public:
+    WorkspaceVector(FujinagaWorkspace& workspace, size_t size)
+      : m_workspace(workspace), m_vec(workspace.acquire_vector(size)) {}
+    ~WorkspaceVector() {
+      m_workspace.release_vector(m_vec);
+    }
+    IntVector& vec() { return *m_vec; }
+  private:
+    WorkspaceVector(const WorkspaceVector&);
+    WorkspaceVector& operator=(const WorkspaceVector&);
+    FujinagaWorkspace& m_workspace;
+    IntVector* m_vec;
+  };
+
   // Param objects simply encapsulate any parameters to the algorithm as a whole.
   // This makes it easier to pass all the different parameters around.
   class Param {
   public:
     Param(size_t crossing_symbols_ = 0, size_t n_stafflines_ = 0, double staffline_h_ = 0, 
 	  double staffspace_h_ = 0.0, size_t skew_strip_width_ = 0, double max_skew_ = 8.0, 
-	  bool deskew_only_ = false, bool find_only_ = false, bool undo_deskew_ = false) {
+	  bool deskew_only_ = false, bool find_only_ = false, bool undo_deskew_ = false,
+	  int n_threads_ = 1, FujinagaWorkspace* workspace_ = NULL) {
       n_stafflines = n_stafflines_;
       
       if (crossing_symbols_ > 2)
@@ -121,6 +432,8 @@ namespace Aomr {
       deskew_only = deskew_only_;
       find_only = find_only_;
       undo_deskew = undo_deskew_;
+      n_threads = n_threads_;
+      workspace = workspace_;
     }
     size_t crossing_symbols;
     size_t n_stafflines;
@@ -131,6 +444,8 @@ namespace Aomr {
     bool deskew_only;
     bool find_only;
     bool undo_deskew;
+    int n_threads; // <= 0: all available, 1: serial
+    FujinagaWorkspace* workspace; // NULL: temporaries are not kept between calls
     vector<DeskewData> deskew_data;
     void add_deskew_info(IntVector *offsets, Rect rect)
     {
@@ -155,10 +470,18 @@ namespace Aomr {
     }
     template<class T> void undo_deskews(T& image)
     {
-      if(!undo_deskew)
+      if(!undo_deskew || deskew_data.empty())
+        return;
+      ShearField(deskew_data, skew_strip_width, image).apply(image);
+    }
+    // undoes the deskews on two images of the same size
+    template<class T> void undo_deskews(T& image1, T& image2)
+    {
+      if(!undo_deskew || deskew_data.empty())
         return;
-      for(typeof(deskew_data.rend()) i=deskew_data.rbegin();i<deskew_data.rend();++i)
-        i->undo_deskew(image, skew_strip_width);
+      ShearField field(deskew_data, skew_strip_width, image1);
+      field.apply(image1);
+      field.apply(image2);
     }
   };
 
@@ -322,73 +645,64 @@ namespace Aomr {
     return((double)total / (double)count);
   }
 
-  // cross-correlates two sets of projections
-  // QUESTION: This code is a bit of a mystery to me
-  int cross_correlate(IntVector* proj1, IntVector* proj2, int offset, int max_shift) {
-    if (proj1->size() != proj2->size())
-      throw std::length_error("cross_correlate proj1.size != proj2.size");
-
-    int i, j;
-    IntVector::iterator old = proj1->begin();
-    IntVector::iterator new_data = proj2->begin();
-    int n = int(proj1->size());
-    IntVector::iterator new_limit;
-    int size = max_shift * 2 + 1;
-
-    IntVector total(size);
-
-    if (offset >= 0) {
-      new_limit = new_data + (n - max_shift - offset - 1);
-      new_data += max_shift + offset;
-    } else {
-      // This looks a lot scarier than it is.  If -offset > proj1.size(), then
-      // new_limit ends up being < new_data, so the loop is never run anyway.
-      old -= offset;
-      new_limit = new_data + (n - max_shift + offset - 1);
-      new_data += max_shift;
-    }
-
-    for (; new_data < new_limit; old++, new_data++) {
-      if (*new_data != 0) {
-	IntVector::iterator pold = old;
-	int newv = *new_data;
-				
-	for (IntVector::iterator ptot = total.begin(); ptot < total.end(); pold++, ptot++) {
-	  if (*pold != 0)
-	    *ptot += *pold * newv;
-	}
-      }
-    }
-    
-    j = (std::max_element(total.begin(), total.end()) - total.begin()) - max_shift;
-    old = proj1->begin();
-
-    if (j == max_shift || -j == max_shift) {	/* ignore */
-      return (offset);
-    }
-    for (i = 0; i < size; i++)
-      if (total[i] != 0)
-	break;
-    if (i == size)
-      j = 0;
-    return (-j + offset);
-  }
-
   ///////////////////////////////////////////////////////////////////////////////////////////////
   // STAFF LINE FINDING AND DESKEWING
 
   // Returns true if the rect is so small that it is very unlikely to contain a staff
   // The threshold is based on the passed in staffspace_h
-  inline bool rect_too_small_to_be_staff(Param& param, Rect& rect, double staffspace_h) {
+  // (*n_stafflines* is the number of stafflines of the staff; a single line
+  // has no height to check)
+  inline bool rect_too_small_to_be_staff(size_t n_stafflines, Rect& rect, double staffspace_h) {
     // was: return (rect.ncols() < 200 || rect.nrows() < 20);
-    return (rect.ncols() < staffspace_h * param.n_stafflines * 2 ||
-	    rect.nrows() < staffspace_h * (param.n_stafflines / 2.0));
+    return (rect.ncols() < staffspace_h * n_stafflines * 2 ||
+	    (n_stafflines > 1 && rect.nrows() < staffspace_h * (n_stafflines / 2.0)));
+  }
+
+  // Autodetection of the number of stafflines (Param::n_stafflines == 0).
+  // Estimates the number of stafflines of a staff candidate from its peaks
+  // [begin, end) in the y-projection of the page, as found by locate_staves
+  // (*origin* is added to the peak positions to get indices into *yproj*).
+  // The estimate is the largest number of consecutive peaks that are about one
+  // *space* (staffline_h + staffspace_h) apart.  A single line must be at least
+  // half as strong as *max_proj*, the strongest line of the page; otherwise
+  // (e.g. for text) 0 is returned.
+  inline size_t estimate_n_stafflines(IntVector::iterator begin, IntVector::iterator end, int origin,
+				      IntVector* yproj, int space, int max_proj) {
+    if (begin == end)
+      return 0;
+    int tolerance = std::max(space / 3, 1);
+    size_t best = 1, chain = 1;
+    for (IntVector::iterator i = begin + 1; i != end; ++i) {
+      if (std::abs(*i - *(i - 1) - space) <= tolerance)
+	++chain;
+      else
+	chain = 1;
+      best = std::max(best, chain);
+    }
+    if (best > 1)
+      return best;
+    for (IntVector::iterator i = begin; i != end; ++i)
+      if ((*yproj)[*i + origin] * 2 >= max_proj)
+	return 1;
+    return 0;
   }
 
   inline bool is_staffline_and_staffspace_reasonable(double staffline_h, double staffspace_h) {
     return !(staffline_h > staffspace_h / 2.0 || staffspace_h <= 6.0 || staffline_h < 1.0);
   }
 
+  inline void check_rough_staffline_and_staffspace_height(double staffline_h, double staffspace_h) {
+    // MGD: This was (staffline_h > staffspace_h), but this was changed because
+    // some images with lots of hashing patterns would get misrecognized as
+    // staves.
+    debug_message("staffline_h: " << staffline_h << " staffspace_h: " << staffspace_h);
+    if (!is_staffline_and_staffspace_reasonable(staffline_h, staffspace_h)) {
+      char temp[256];
+      sprintf(temp, "Staffline height (%.02f) and staffspace height (%.02f) are not reasonable.", staffline_h, staffspace_h);
+      throw std::runtime_error(temp);
+    }
+  }
+
   // Finds a rough value for staffline_h and staffspace_h
   // The results are returned by reference
   template<class T>
@@ -405,14 +719,153 @@ namespace Aomr {
     debug_message("find_rough_staffline_and_staffspace_height");
     staffline_h = (double) most_frequent_run(original, runs::Black(), runs::Vertical());
     staffspace_h = (double) most_frequent_run(original, runs::White(), runs::Vertical());
-    // MGD: This was (staffline_h > staffspace_h), but this was changed because
-    // some images with lots of hashing patterns would get misrecognized as
-    // staves.
-    debug_message("staffline_h: " << staffline_h << " staffspace_h: " << staffspace_h);
-    if (!is_staffline_and_staffspace_reasonable(staffline_h, staffspace_h)) {
-      char temp[256];
-      sprintf(temp, "Staffline height (%.02f) and staffspace height (%.02f) are not reasonable.", staffline_h, staffspace_h);
-      throw std::runtime_error(temp);
+    check_rough_staffline_and_staffspace_height(staffline_h, staffspace_h);
+  }
+
+  // The same for an image given by its vertical runs: both histograms are
+  // taken from the runs in a single pass.
+  inline void find_rough_staffline_and_staffspace_height(ColumnRuns& original, double& staffline_h,
+							 double& staffspace_h) {
+    debug_message("find_rough_staffline_and_staffspace_height (runs)");
+    int black_run, white_run;
+    original.most_frequent_runs(black_run, white_run);
+    staffline_h = (double) black_run;
+    staffspace_h = (double) white_run;
+    check_rough_staffline_and_staffspace_height(staffline_h, staffspace_h);
+  }
+
+  // Copies *original* into *image_hfilter* with all vertical black runs longer than
+  // *max_run* and all (8-connected) black components narrower than *min_width*
+  // removed.  This gives the same result as
+  //
+  //   image_copy_fill(original, image_hfilter);
+  //   filter_tall_runs(image_hfilter, max_run, runs::Black());
+  //   ccs::filter_narrow(*cc_analysis(image_hfilter), min_width);
+  //
+  // but needs only two passes over the image and no connected component
+  // objects (and the remaining pixels are not labeled):
+  //  1. copy row by row while tracking the vertical run in every column;
+  //     when a run ends and is too tall, it is erased again
+  //  2. label the horizontal runs row by row with a union-find that keeps
+  //     track of the horizontal extent of every component; only the runs of
+  //     narrow components are erased at the end
+  struct HRun {
+    int x0, x1; // inclusive
+  };
+
+  inline int _hrun_find(IntVector& parent, int i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  }
+
+  template<class T, class U>
+  void filter_tall_runs_and_narrow_ccs(T& original, U& image_hfilter, size_t max_run,
+				       int min_width) {
+    typedef typename T::row_iterator SrcRow;
+    typedef typename U::row_iterator DstRow;
+    int nrows = int(original.nrows());
+    int ncols = int(original.ncols());
+    typename U::value_type black_value = black(image_hfilter);
+    typename U::value_type white_value = white(image_hfilter);
+
+    // pass 1: copy and remove tall vertical runs
+    {
+      IntVector run_start(ncols, -1);
+      SrcRow src = original.row_begin();
+      DstRow dst = image_hfilter.row_begin();
+      for (int r = 0; r < nrows; ++r, ++src, ++dst) {
+	typename SrcRow::iterator s = src.begin();
+	typename DstRow::iterator d = dst.begin();
+	for (int c = 0; c < ncols; ++c, ++s, ++d) {
+	  if (is_black(*s)) {
+	    *d = black_value;
+	    if (run_start[c] < 0)
+	      run_start[c] = r;
+	  } else {
+	    *d = white_value;
+	    if (run_start[c] >= 0) {
+	      if (size_t(r - run_start[c]) > max_run) {
+		typename U::col_iterator col = image_hfilter.col_begin() + c;
+		std::fill(col.begin() + run_start[c], col.begin() + r, white_value);
+	      }
+	      run_start[c] = -1;
+	    }
+	  }
+	}
+      }
+      // runs that reach the bottom of the image
+      for (int c = 0; c < ncols; ++c) {
+	if (run_start[c] >= 0 && size_t(nrows - run_start[c]) > max_run) {
+	  typename U::col_iterator col = image_hfilter.col_begin() + c;
+	  std::fill(col.begin() + run_start[c], col.begin() + nrows, white_value);
+	}
+      }
+    }
+
+    if (min_width <= 1)
+      return;
+
+    // pass 2: label horizontal runs and track the extent of the components
+    std::vector<HRun> hruns;
+    IntVector row_start(nrows + 1);
+    IntVector parent, min_x, max_x;
+    {
+      DstRow dst = image_hfilter.row_begin();
+      for (int r = 0; r < nrows; ++r, ++dst) {
+	row_start[r] = int(hruns.size());
+	typename DstRow::iterator d = dst.begin();
+	for (int c = 0; c < ncols; ) {
+	  if (!is_black(*d)) {
+	    ++c, ++d;
+	    continue;
+	  }
+	  HRun run;
+	  run.x0 = c;
+	  while (c < ncols && is_black(*d))
+	    ++c, ++d;
+	  run.x1 = c - 1;
+	  int id = int(hruns.size());
+	  hruns.push_back(run);
+	  parent.push_back(id);
+	  min_x.push_back(run.x0);
+	  max_x.push_back(run.x1);
+	}
+	// join with the 8-connected runs of the previous row
+	if (r > 0) {
+	  int a = row_start[r - 1], a_end = row_start[r];
+	  int b = row_start[r], b_end = int(hruns.size());
+	  while (a < a_end && b < b_end) {
+	    if (hruns[a].x0 <= hruns[b].x1 + 1 && hruns[b].x0 <= hruns[a].x1 + 1) {
+	      int ra = _hrun_find(parent, a), rb = _hrun_find(parent, b);
+	      if (ra != rb) {
+		if (ra > rb)
+		  std::swap(ra, rb);
+		parent[rb] = ra;
+		min_x[ra] = std::min(min_x[ra], min_x[rb]);
+		max_x[ra] = std::max(max_x[ra], max_x[rb]);
+	      }
+	    }
+	    if (hruns[a].x1 < hruns[b].x1)
+	      ++a;
+	    else
+	      ++b;
+	  }
+	}
+      }
+      row_start[nrows] = int(hruns.size());
+    }
+
+    DstRow dst = image_hfilter.row_begin();
+    for (int r = 0; r < nrows; ++r, ++dst) {
+      typename DstRow::iterator d = dst.begin();
+      for (int i = row_start[r]; i < row_start[r + 1]; ++i) {
+	int root = _hrun_find(parent, i);
+	if (max_x[root] - min_x[root] + 1 < min_width)
+	  std::fill(d + hruns[i].x0, d + hruns[i].x1 + 1, white_value);
+      }
     }
   }
 
@@ -426,20 +879,12 @@ namespace Aomr {
     debug_message("despeckling");
     despeckle(original, std::max(5, (int)(staffline_h)));
 
-    // filter vertically thick things
-    debug_message("filtering tall runs");
-    image_copy_fill(original, image_hfilter);
-    filter_tall_runs(image_hfilter, int((staffline_h * 2)), runs::Black());
-
-    // filter horizontally short things using connected-components - this is so that
-    // this will work if the image is skewed.
-    debug_message("filtering horizontally short things");
-
-    typedef typename ImageFactory<T>::ccs_type ccs_type;
-    ccs_type* cc;
-    cc = (ccs_type*)cc_analysis(image_hfilter);
-    ccs::filter_narrow(*cc, (int)staffspace_h);
-    delete_connected_components(cc);
+    // filter vertically thick things, then filter horizontally short things
+    // using connected-components - this is so that this will work if the image
+    // is skewed.
+    debug_message("filtering tall runs and horizontally short things");
+    filter_tall_runs_and_narrow_ccs(original, image_hfilter, size_t(int(staffline_h * 2)),
+				    (int)staffspace_h);
 
     /* ccs_filter_tall() can remove tall things, (hairpins, slurs) 
      * but it's not a good idea to do this now because the page may be 
@@ -475,11 +920,138 @@ namespace Aomr {
     delete typroj;
   }
 
+  // Computes the y-projections of the first *n_strips* vertical strips of width
+  // *wid* into the strip-major buffer *strips*, i.e. the projection of strip i
+  // is strips[i * nrows] ... strips[(i + 1) * nrows - 1].  The strips are
+  // independent, so they are counted concurrently by *n_threads* threads.
   template<class T>
-  IntVector *find_skew(T& image, IntVector** yproj, int wid, int max_offset)
+  void yproj_vertical_strips(T& image, IntVector& strips, int wid, int n_strips,
+			     int n_threads) {
+    int nrows = int(image.nrows());
+    int ncols = int(image.ncols());
+    strips.resize(size_t(n_strips) * nrows);
+
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (int i = 0; i < n_strips; ++i) {
+      int begin = std::min(i * wid, ncols);
+      int end = std::min(begin + wid, ncols);
+      IntVector::iterator proj = strips.begin() + size_t(i) * nrows;
+      typename T::row_iterator row = image.row_begin();
+      for (int r = 0; r < nrows; ++r, ++row, ++proj) {
+	int count = 0;
+	typename T::row_iterator::iterator col = row.begin() + begin;
+	for (int c = begin; c < end; ++c, ++col)
+	  if (is_black(*col))
+	    ++count;
+	*proj = count;
+      }
+    }
+  }
+
+  // The correlation chain of find_skew over precomputed strip projections
+  // (see yproj_vertical_strips).
+  inline IntVector *find_skew_from_strips(IntVector& strips, size_t image_nrows, size_t image_ncols,
+					  IntVector** yproj, int wid, int max_offset) {
+    int nrows = int(image_nrows);
+    int n_full = int(image_ncols) / wid;
+    int halfway = image_ncols / 2 / wid;
+
+    IntVector* offsets = new IntVector((image_ncols + wid - 1) / wid + 1);
+    IntVector* last_yproj = new IntVector(strips.begin() + size_t(halfway) * nrows,
+					  strips.begin() + size_t(halfway + 1) * nrows);
+    IntVector typroj(nrows);
+
+    try {
+      (*offsets)[halfway] = 0;
+
+      // Right half, right edge, then left half -- in the same order as find_skew
+      int i;
+      for (i = halfway + 1; i < n_full; i++) {
+	std::copy(strips.begin() + size_t(i) * nrows, strips.begin() + size_t(i + 1) * nrows,
+		  typroj.begin());
+	if (array_sum(&typroj) < wid)
+	  (*offsets)[i] = (*offsets)[i - 1];
+	else
+	  (*offsets)[i] = cross_correlate(last_yproj, &typroj, (*offsets)[i - 1], max_offset);
+	array_add(last_yproj, &typroj, (*offsets)[i]);
+      }
+
+      int last_offset = (*offsets)[i - 1];
+      for (; i < (int)offsets->size(); i++)
+	(*offsets)[i] = last_offset;
+
+      for (i = halfway - 1; i >= 0; i--) {
+	std::copy(strips.begin() + size_t(i) * nrows, strips.begin() + size_t(i + 1) * nrows,
+		  typroj.begin());
+	if (array_sum(&typroj) < wid)
+	  (*offsets)[i] = (*offsets)[i + 1];
+	else
+	  (*offsets)[i] = cross_correlate(last_yproj, &typroj, (*offsets)[i + 1], max_offset);
+	array_add(last_yproj, &typroj, (*offsets)[i]);
+      }
+    } catch (std::exception) {
+      delete last_yproj;
+      delete offsets;
+      throw;
+    }
+    *yproj = last_yproj;
+    return offsets;
+  }
+
+  // Parallel version of find_skew: all strip projections are computed up front
+  // into one buffer, then the (inherently sequential) correlation chain is run
+  // over that buffer.  The offsets are identical to those of the serial version.
+  // The buffer is taken from *workspace*, if given.
+  template<class T>
+  IntVector *find_skew_parallel(T& image, IntVector** yproj, int wid, int max_offset,
+				int n_threads, FujinagaWorkspace* workspace = NULL)
   {
+    debug_message("find_skew_parallel");
+
+    int nrows = int(image.nrows());
+    int n_full = int(image.ncols()) / wid;
+    int halfway = image.ncols() / 2 / wid;
+
+    int n_strips = std::max(n_full, halfway + 1);
+    FujinagaWorkspace local_workspace;
+    WorkspaceVector strips_buffer(workspace ? *workspace : local_workspace,
+				  size_t(n_strips) * nrows);
+    IntVector& strips = strips_buffer.vec();
+    yproj_vertical_strips(image, strips, wid, n_strips, n_threads);
+    return find_skew_from_strips(strips, image.nrows(), image.ncols(), yproj, wid, max_offset);
+  }
+
+  // find_skew for an image given by its vertical runs.  The strip
+  // projections are computed from the runs, the offsets are identical
+  // to those of the image.
+  inline IntVector *find_skew(ColumnRuns& image, IntVector** yproj, int wid, int max_offset,
+			      int n_threads = 1, FujinagaWorkspace* workspace = NULL)
+  {
+    debug_message("find_skew (runs)");
+
+    int nrows = int(image.nrows());
+    int n_full = int(image.ncols()) / wid;
+    int halfway = image.ncols() / 2 / wid;
+
+    int n_strips = std::max(n_full, halfway + 1);
+    FujinagaWorkspace local_workspace;
+    WorkspaceVector strips_buffer(workspace ? *workspace : local_workspace,
+				  size_t(n_strips) * nrows);
+    IntVector& strips = strips_buffer.vec();
+    image.yproj_strips(strips, wid, n_strips, musicstaves_num_threads(n_threads));
+    return find_skew_from_strips(strips, image.nrows(), image.ncols(), yproj, wid, max_offset);
+  }
+
+  template<class T>
+  IntVector *find_skew(T& image, IntVector** yproj, int wid, int max_offset,
+		       int n_threads = 1, FujinagaWorkspace* workspace = NULL)
+  {
+    if (musicstaves_num_threads(n_threads) > 1)
+      return find_skew_parallel(image, yproj, wid, max_offset,
+				musicstaves_num_threads(n_threads), workspace);
+
     debug_message("find_skew");
-    
+
     IntVector* offsets = new IntVector((image.ncols() + wid - 1) / wid + 1);
 
     int halfway = image.ncols() / 2 / wid;
@@ -510,34 +1082,79 @@ namespace Aomr {
     return offsets;
   }
 
+  // Shears the columns [col, col + ncols) by the same *distance*, with the
+  // same semantics as shear_column (the pixels moved in at the border are
+  // copies of the border pixel). The shear is done as copies of row segments,
+  // so that the pixels are accessed in memory order.
+  template<class T>
+  void shear_column_block(T& image, size_t col, size_t ncols, int distance) {
+    typedef typename T::row_iterator row_iterator;
+    size_t nrows = image.nrows();
+    if (distance == 0 || ncols == 0)
+      return;
+    if (size_t(std::abs(distance)) >= nrows)
+      throw std::range_error("Tried to shear column block too far");
+
+    row_iterator first = image.row_begin();
+    if (distance > 0) {
+      // rows are moved downwards, so we must copy bottom up
+      for (size_t r = nrows - 1; r >= size_t(distance); --r) {
+	row_iterator src = first + (r - distance);
+	row_iterator dst = first + r;
+	std::copy(src.begin() + col, src.begin() + (col + ncols), dst.begin() + col);
+      }
+      for (size_t r = 1; r < size_t(distance); ++r) {
+	row_iterator dst = first + r;
+	std::copy(first.begin() + col, first.begin() + (col + ncols), dst.begin() + col);
+      }
+    } else {
+      size_t d = size_t(-distance);
+      for (size_t r = 0; r + d < nrows; ++r) {
+	row_iterator src = first + (r + d);
+	row_iterator dst = first + r;
+	std::copy(src.begin() + col, src.begin() + (col + ncols), dst.begin() + col);
+      }
+      row_iterator last = first + (nrows - 1);
+      for (size_t r = nrows - d; r < nrows - 1; ++r) {
+	row_iterator dst = first + r;
+	std::copy(last.begin() + col, last.begin() + (col + ncols), dst.begin() + col);
+      }
+    }
+  }
+
   // This function takes an IntVector of shear distances, and deskews the image (in place)
   // precondition: offsets->size() == image.ncols() / width
   // MGD: was "runs_adjust"
+  // Neighbouring columns with the same (interpolated) shear distance are
+  // sheared together with shear_column_block, which is much faster than
+  // shearing each column with shear_column.
   template<class T>
   void deskew(T& image, IntVector *offsets, int width) {
     debug_message("deskew");
-    typename IntVector::iterator offset = offsets->begin();
-
-    for (size_t col = 0; col < image.ncols(); col++) {
-      double inc;   /* interpolation inc per pixel */
-      int distance; /* offset value after interpolation for the column */
-      size_t index = col / width;
-      // Be careful not to read off the end of offset list
-      if (index >= offsets->size() - 1) {
-	distance = offset[offsets->size() - 1];
-      } else {
-	inc = (offset[index] - offset[index + 1]) / (double)width; /* linear interpolation */
-	distance = (int)::round((col % width) * inc) - offset[index];
+    size_t ncols = image.ncols();
+    size_t nrows = image.nrows();
+
+    size_t block_start = 0;
+    int block_distance = 0;
+    for (size_t col = 0; col < ncols; col++) {
+      int distance = deskew_distance(col, offsets, width, nrows);
+      if (col == 0) {
+	block_distance = distance;
+      } else if (distance != block_distance) {
+	shear_column_block(image, block_start, col - block_start, block_distance);
+	block_start = col;
+	block_distance = distance;
       }
-      // Threshold the distance so we don't over-adjust (beyond the edge of the image).
-      // Frankly, if we're deskewing by that much there's something seriously wrong elsewhere, 
-      // but it's better than crasing <wink>
-      if (distance >= (int)image.nrows())
-	distance = image.nrows() - 1;
-      else if (distance <= -(int)image.nrows())
-	distance = -(int)image.nrows() + 1;
-      shear_column(image, col, distance);
     }
+    if (ncols > 0)
+      shear_column_block(image, block_start, ncols - block_start, block_distance);
+  }
+
+  // The same for an image given by its vertical runs
+  inline void deskew(ColumnRuns& image, IntVector *offsets, int width) {
+    debug_message("deskew (runs)");
+    for (size_t col = 0; col < image.ncols(); col++)
+      image.shear_column(col, deskew_distance(col, offsets, width, image.nrows()));
   }
 
   // remove tall ccs, such as slurs and dynamic wedges.
@@ -555,7 +1172,7 @@ namespace Aomr {
   // finds the individual stafflines within a staff and deskews the staff
   template<class T>
   Staff find_stafflines(Param& param, Page& page, T& image_original, T& image_hfilter, 
-			Rect& rect, IntVector* yproj) {
+			Rect& rect, IntVector* yproj, size_t n_stafflines) {
     print_rect("find_stafflines", rect);
 
     double staffline_h, staffspace_h;
@@ -603,7 +1220,8 @@ namespace Aomr {
 	  delete_connected_components(cc);
 	  
 	  IntVector* offsets = find_skew(subimage, &local_yproj, param.skew_strip_width, 
-					 int(std::min(param.max_skew, staffspace_h)));
+					 int(std::min(param.max_skew, staffspace_h)), param.n_threads,
+					 param.workspace);
 	  deskew(image_hhfilter, offsets, param.skew_strip_width);
 	  
 	  IntVector *hh_yproj = projection_rows(image_hhfilter);
@@ -625,7 +1243,7 @@ namespace Aomr {
 	deriv = array_deriv(local_yproj->begin(), local_yproj->end());
 	n_peaks = array_local_maxima(deriv, local_yproj->begin(), local_yproj->end(), avg);
 	
-	if (n_peaks > (int)param.n_stafflines) {
+	if (n_peaks > (int)n_stafflines) {
 	  try {
 	    peaks_sort(deriv, local_yproj);
 	  } catch (std::exception) {
@@ -633,17 +1251,21 @@ namespace Aomr {
 	    delete local_yproj;
 	    throw;
 	  }
-	  deriv->resize(param.n_stafflines);
+	  deriv->resize(n_stafflines);
 	  std::sort(deriv->begin(), deriv->end());
-	  n_peaks = param.n_stafflines;
-	} else if (n_peaks < (int)param.n_stafflines) {
-	  // TODO: For autodetecting the number of stafflines, this should not be an exception
+	  n_peaks = n_stafflines;
+	} else if (n_peaks > 0 && n_peaks < (int)n_stafflines && param.n_stafflines == 0) {
+	  // The estimated number of stafflines is only a guess, so the
+	  // autodetected staff keeps the lines actually found
+	  debug_message("estimated " << n_stafflines << " stafflines, found " << n_peaks);
+	  n_stafflines = n_peaks;
+	} else if (n_peaks < (int)n_stafflines) {
 	  delete deriv;
 	  delete local_yproj;
 // 	  if (param.find_only)
 // 	    throw std::runtime_error("Less than the expected number of stafflines.");
 // 	  else {
-	    std::cerr << "Warning: Less than " << param.n_stafflines << " stafflines." << std::endl;
+	    std::cerr << "Warning: Less than " << n_stafflines << " stafflines." << std::endl;
 	    staff.ncols(0);
 	    staff.nrows(0);
 	    return staff;
@@ -672,12 +1294,20 @@ namespace Aomr {
     //
     // the xproj is slightly thinner to get around braces 
 
-    if (rect.nrows() < staffline_h * 2)
+    if (n_stafflines > 1 && rect.nrows() < staffline_h * 2)
       throw std::runtime_error("Proposed staff is too short.");
 
     { 
-      IntVector *xproj = xproj_horizontal_strip(image_original, (int)(rect.ul_y() + staffline_h),
-						(int)(rect.nrows() - staffline_h * 2));
+      // A single line has no inside, so the strip around the line is used
+      IntVector *xproj;
+      if (n_stafflines > 1)
+	xproj = xproj_horizontal_strip(image_original, (int)(rect.ul_y() + staffline_h),
+				       (int)(rect.nrows() - staffline_h * 2));
+      else {
+	int top = std::max(int(rect.ul_y() - staffline_h), 0);
+	xproj = xproj_horizontal_strip(image_original, top,
+				       std::max(int(rect.ul_y() + staffline_h) - top + 1, 1));
+      }
       
       int width = 3;
       int column;
@@ -734,7 +1364,8 @@ namespace Aomr {
 	IntVector* local_yproj;
 	view_type subimage(image_original, orig_rect);
 	IntVector* offset_array = find_skew(subimage, &local_yproj, param.skew_strip_width,
-					    int(std::min(param.max_skew * 3, staffspace_h)));
+					    int(std::min(param.max_skew * 3, staffspace_h)),
+					    param.n_threads, param.workspace);
 	delete local_yproj;
       
 	// since the entire width of the original image must be sheared, offset_array
@@ -824,10 +1455,15 @@ namespace Aomr {
   // Finds a single set of stafflines
   template<class T>
   void find_staff(Param& param, Page& page, T& image_original, T& image_hfilter, Rect& rect, 
-		  double staffline_h, int space) {
+		  double staffline_h, int space, size_t n_stafflines) {
     debug_message(" find_staff");
 
-    remove_side_margins(image_hfilter, rect, (size_t)(staffline_h * 4));
+    // An autodetected staff scales the threshold with its number of lines;
+    // a single line needs at least half of its height
+    double margin_lines = 4;
+    if (param.n_stafflines == 0)
+      margin_lines = n_stafflines > 1 ? n_stafflines - 1 : 0.5;
+    remove_side_margins(image_hfilter, rect, (size_t)(staffline_h * margin_lines));
 
     // MGD: removed a chunk (now gone) to deal with David Lewis' problem for not finding
     // all of the staff lines.  Will break the ability to find multiple staves with a break 
@@ -837,7 +1473,7 @@ namespace Aomr {
     rect.ul_y(std::max((int)rect.ul_y() - space, 0)); // use space as margins to allow for minor skews
     rect.lr_y(std::min((int)rect.lr_y() + space, (int)image_hfilter.lr_y()));
 
-    if (rect_too_small_to_be_staff(param, rect, space))
+    if (rect_too_small_to_be_staff(n_stafflines, rect, space))
       return;
 
     /// MGD: removed a chunk (now gone) to deal with David Lewis' problem for not finding
@@ -852,7 +1488,8 @@ namespace Aomr {
     // yproj = yproj_vertical_strip(image_original_unskewed, rect.ul_x(), rect.ncols());
     IntVector* yproj = yproj_vertical_strip(image_original, rect.ul_x(), rect.ncols());
     try {
-      Staff staff = find_stafflines(param, page, image_original, image_hfilter, rect, yproj);
+      Staff staff = find_stafflines(param, page, image_original, image_hfilter, rect, yproj,
+				    n_stafflines);
       if (staff.nrows() > 0 and staff.ncols() > 0)
 	page.add_staff(staff);
     } catch (std::exception) {
@@ -863,6 +1500,8 @@ namespace Aomr {
   }
 
   // Finds all of the staves on the page
+  // With Param::n_stafflines == 0, the number of stafflines of every staff
+  // candidate is estimated from its peaks (see estimate_n_stafflines).
   template<class T>
   void locate_staves(Param& param, Page& page, IntVector* yproj, double staffline_h, 
 		     double staffspace_h, T& image_original, T& image_hfilter) {
@@ -880,15 +1519,27 @@ namespace Aomr {
     // TODO: Fix this 100 threshold.  Dalitz and Karsten use max(array) / 5.0 -- is that
     //       a reasonable thing to do?
     array_local_maxima(deriv, yproj->begin(), yproj->end(), 100);
+    if (deriv->empty()) {
+      // nothing that looks like a staff (e.g. an empty band in band mode)
+      delete deriv;
+      return;
+    }
     data = deriv->begin();		/* peaks in yproj */
     
     last = data[0];
     last_i = 0;
 
+    // smallest number of peaks of a staff candidate, and the strongest
+    // line of the page (for autodetection)
+    int min_peaks = param.n_stafflines > 0 ? (int)param.n_stafflines : 1;
+    int max_proj = 0;
+    for (j = 0; j < (int)deriv->size(); j++)
+      max_proj = std::max(max_proj, (*yproj)[data[j]]);
+
     print_rect("Whole image", image_hfilter);
     
     for (i = 1; i <= (int)deriv->size(); i++) {
-      if ((i == (int)deriv->size() && i - last_i >= (int)param.n_stafflines)
+      if ((i == (int)deriv->size() && i - last_i >= min_peaks)
 	  || (data[i] - data[i - 1] > (space * 2))) {
 	int n_peaks = i - last_i;
 
@@ -897,23 +1548,34 @@ namespace Aomr {
 	print_rect("candidate", rect);
 
 	last = data[i];
+
+	size_t n_stafflines = param.n_stafflines;
+	if (n_stafflines == 0) {
+	  n_stafflines = estimate_n_stafflines(data + last_i, data + i, 0, yproj, space, max_proj);
+	  debug_message("estimated number of stafflines: " << n_stafflines);
+	  if (n_stafflines == 0) {
+	    last_i = i;
+	    continue;
+	  }
+	}
 	
-	if (rect_too_small_to_be_staff(param, rect, staffspace_h)) {	/* too small */
+	if (rect_too_small_to_be_staff(n_stafflines, rect, staffspace_h)) {	/* too small */
 	  debug_message("rect too small");
 	  last_i = i;
 	  continue;
 	}
 	
 	// was (n_peaks < 10)
-	if (n_peaks < int(param.n_stafflines * 2)) {
+	if (n_peaks < int(n_stafflines * 2)) {
 	  debug_message("n_peaks < 10");
-	  if (n_peaks < (int)param.n_stafflines - 1) {
-	    debug_message("n_peaks < param.n_stafflines");
+	  if (n_peaks < (int)n_stafflines - 1) {
+	    debug_message("n_peaks < n_stafflines");
 	    last_i = i;
 	    continue;
 	  }	
 	  try {
-	    find_staff(param, page, image_original, image_hfilter, rect, staffline_h, space);
+	    find_staff(param, page, image_original, image_hfilter, rect, staffline_h, space,
+		       n_stafflines);
 	  } catch (std::exception) {
 	    delete deriv;
 	    throw;
@@ -936,10 +1598,11 @@ namespace Aomr {
 	  n1 = array_local_maxima(deriv1, subyp, subyp + subyp_size, avg);
 
 	  // was (n1 < 10)
-	  if (n1 < int(param.n_stafflines * 2)) {
+	  if (n1 < int(n_stafflines * 2)) {
 	    debug_message("n1 < 10");
 	    try {
-	      find_staff(param, page, image_original, image_hfilter, rect, staffline_h, space);
+	      find_staff(param, page, image_original, image_hfilter, rect, staffline_h, space,
+			 n_stafflines);
 	    } catch (std::exception) {
 	      delete deriv1; delete deriv;
 	      throw;
@@ -952,17 +1615,22 @@ namespace Aomr {
 	    int last1 = data1[0] + orig;
 
 	    for (j = 1; j <= (int)deriv1->size(); j++)
-	      if ((j == (int)deriv1->size() && j - last_j >= (int)param.n_stafflines)
+	      if ((j == (int)deriv1->size() && j - last_j >= min_peaks)
 		  || data1[j] - data1[j - 1] > (int) (space * 2)) {
 		Rect rect(Point(0, last1), Point(image_hfilter.lr_x(), data1[j - 1] + orig - 1));
 		print_rect("candidate 2", rect);
-		if (rect_too_small_to_be_staff(param, rect, staffspace_h)) {
+		size_t n_lines = param.n_stafflines;
+		if (n_lines == 0)
+		  n_lines = estimate_n_stafflines(data1 + last_j, data1 + j, offset, yproj, space,
+						  max_proj);
+		if (n_lines == 0 || rect_too_small_to_be_staff(n_lines, rect, staffspace_h)) {
 		  debug_message("rect too small");
 		  last_j = j;
 		  continue;
 		}
 		try {
-		  find_staff(param, page, image_original, image_hfilter, rect, staffline_h, space);
+		  find_staff(param, page, image_original, image_hfilter, rect, staffline_h, space,
+			     n_lines);
 		} catch (std::exception) {
 		  delete deriv; delete deriv1;
 		  throw;
@@ -1037,11 +1705,11 @@ namespace Aomr {
     }
   }
 
+  // Returns the region of the page (full width) that belongs to staff *staff_no*
+  // when the stafflines are removed.  The regions of neighbouring staves may
+  // overlap.
   template<class T>
-  void filter_staff(Param& param, Page& page, int staff_no, T& image_original,
-		    T& image_hfilter, T& image_removed) {
-    debug_message("filter_staff");
-    
+  Rect filter_staff_rect(Page& page, int staff_no, T& image_original) {
     Staff& staff = page.staves[staff_no];
     
     Rect rect = staff;
@@ -1087,13 +1755,15 @@ namespace Aomr {
 
       delete yproj;
     }
+    return rect;
+  }
 
-    print_rect("filter_staff rect", rect);
-    debug_message(staff.staffline_h);
-    print_array("stafflines", &(staff.staffline_pos));
-
-    data_type subimage_data(rect.size(), rect.ul());
-    view_type subimage(subimage_data, rect);
+  // Computes the staff region *rect* of image_original without the stafflines
+  // of *staff* into *subimage* (which must have the size of *rect*).
+  // Only reads image_original and image_hfilter.
+  template<class T>
+  void filter_staff_region(const Staff& staff, const Rect& rect, T& image_original,
+			   T& image_hfilter, view_type& subimage) {
     image_copy_fill(view_type(image_hfilter, rect), subimage);
 
     typedef typename ImageFactory<T>::ccs_type ccs_type;
@@ -1105,10 +1775,72 @@ namespace Aomr {
     delete_connected_components(cc);
 
     xor_image(subimage, view_type(image_original, rect));
+  }
+
+  template<class T>
+  void filter_staff(Param& param, Page& page, int staff_no, T& image_original,
+		    T& image_hfilter, T& image_removed) {
+    debug_message("filter_staff");
+    
+    Staff& staff = page.staves[staff_no];
+    Rect rect = filter_staff_rect(page, staff_no, image_original);
+
+    print_rect("filter_staff rect", rect);
+    debug_message(staff.staffline_h);
+    print_array("stafflines", &(staff.staffline_pos));
+
+    data_type subimage_data(rect.size(), rect.ul());
+    view_type subimage(subimage_data, rect);
+    filter_staff_region(staff, rect, image_original, image_hfilter, subimage);
+
     view_type subimage1(image_removed, rect);
     image_copy_fill(subimage, subimage1);
   }
 
+  // Same as calling filter_staff for every staff, but the staves are processed
+  // concurrently by *n_threads* threads.  Every staff is filtered into an image
+  // of its own, and these are copied into image_removed in staff order
+  // afterwards, so that overlapping staff regions give the same result as
+  // in the serial version.
+  template<class T>
+  void filter_staves_parallel(Param& param, Page& page, T& image_original,
+			      T& image_hfilter, T& image_removed, int n_threads) {
+    debug_message("filter_staves_parallel");
+    int n_staves = int(page.staves.size());
+    vector<Rect> rects(n_staves);
+    vector<data_type*> results(n_staves, (data_type*)NULL);
+    // exceptions must not leave the parallel region
+    vector<std::string> errors(n_staves);
+
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (int i = 0; i < n_staves; ++i) {
+      try {
+	rects[i] = filter_staff_rect(page, i, image_original);
+	results[i] = new data_type(rects[i].size(), rects[i].ul());
+	view_type subimage(*results[i], rects[i]);
+	filter_staff_region(page.staves[i], rects[i], image_original, image_hfilter, subimage);
+      } catch (std::exception& e) {
+	errors[i] = e.what();
+	if (errors[i].empty())
+	  errors[i] = "filter_staff failed";
+      }
+    }
+
+    for (int i = 0; i < n_staves; ++i) {
+      if (!errors[i].empty()) {
+	for (int j = 0; j < n_staves; ++j)
+	  delete results[j];
+	throw std::runtime_error(errors[i]);
+      }
+    }
+    for (int i = 0; i < n_staves; ++i) {
+      view_type subimage(*results[i], rects[i]);
+      view_type subimage1(image_removed, rects[i]);
+      image_copy_fill(subimage, subimage1);
+      delete results[i];
+    }
+  }
+
   // was sl_create
   RectVector* create_staffline_table(Page& page) {
     debug_message("create_staffline_table");
@@ -1136,14 +1868,15 @@ namespace Aomr {
     return sl_table;
   }
 
+  // The columns are independent and are processed by *n_threads* threads.
   template<class T>
-  void filter_stafflines(Param& param, Page& page, T& image_removed) {
+  void filter_stafflines(Param& param, Page& page, T& image_removed, int n_threads = 1) {
     debug_message("filter_stafflines");
+    if (page.total_stafflines == 0)
+      return;
 
     // go through the image as vertical run-length data
-    typename T::col_iterator i = image_removed.col_begin();
     typedef typename T::row_iterator Iter;
-    int curr_col = 0;
 
     RectVector* sl_table = create_staffline_table(page);
 
@@ -1153,7 +1886,11 @@ namespace Aomr {
       if (staff->staffline_h > max_staffline_h)
         max_staffline_h = staff->staffline_h;
 
-    for (size_t c = 0; i != image_removed.col_end(); ++i, ++curr_col, ++c) {
+    int ncols = int(image_removed.ncols());
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+    for (int curr_col = 0; curr_col < ncols; ++curr_col) {
+      size_t c = size_t(curr_col);
+      typename T::col_iterator i = image_removed.col_begin() + curr_col;
       Iter j = i.begin();
       Iter end = i.end();
       while (j != end) {
@@ -1195,9 +1932,15 @@ namespace Aomr {
 		     T& image_removed) {
     debug_message("filter_staves");
     find_staffline_height_for_staves(param, page, image_hfilter);
-    for (size_t i = 0; i < page.staves.size(); ++i)
-      filter_staff(param, page, i, image_original, image_hfilter, image_removed);
-    filter_stafflines(param, page, image_removed);
+    int n_threads = musicstaves_num_threads(param.n_threads);
+    if (n_threads > 1 && page.staves.size() > 1) {
+      filter_staves_parallel(param, page, image_original, image_hfilter, image_removed,
+			     n_threads);
+    } else {
+      for (size_t i = 0; i < page.staves.size(); ++i)
+	filter_staff(param, page, i, image_original, image_hfilter, image_removed);
+    }
+    filter_stafflines(param, page, image_removed, n_threads);
   }
 
   double calculate_max_skew(double max_skew, size_t deskew_strip_width) {
@@ -1236,7 +1979,8 @@ namespace Aomr {
 
       offset_array =
         find_skew(image_hfilter, &yproj, param.skew_strip_width,
-                  int(std::min(param.max_skew, staffspace_h)));
+                  int(std::min(param.max_skew, staffspace_h)), param.n_threads,
+                  param.workspace);
     }
 
     data_type* result_data = new data_type(Dim(original.ncols(), original.nrows()),
@@ -1252,13 +1996,62 @@ namespace Aomr {
     return result;
   }
 
+  // The same as global_staffline_deskew, but all steps work on the vertical
+  // runs of the image (see column_runs.hpp) instead of on dense copies of it,
+  // and the result is an RLE image.  Unlike global_staffline_deskew, *original*
+  // is not despeckled in place.  The result is pixel for pixel the same.
+  template<class T>
+  rle_view_type* global_staffline_deskew_rle(T& original, Param& param) {
+    ColumnRuns runs(original);
+
+    double staffline_h, staffspace_h;
+    if (param.staffline_h <= 0.0 || param.staffspace_h <= 0.0)
+      find_rough_staffline_and_staffspace_height(runs, staffline_h, staffspace_h);
+    else {
+      staffline_h = param.staffline_h; staffspace_h = param.staffspace_h;
+    }
+
+    if (param.skew_strip_width <= 0)
+      param.skew_strip_width = int(staffspace_h * 2);
+
+    param.max_skew = calculate_max_skew(param.max_skew, param.skew_strip_width);
+
+    IntVector* yproj;
+    IntVector* offset_array;
+
+    {
+      // the same filters as basic_filtering_step
+      runs.remove_components(size_t(std::max(5, (int)(staffline_h))), 0);
+      ColumnRuns hfilter(runs);
+      hfilter.filter_tall_runs(size_t(int(staffline_h * 2)));
+      hfilter.remove_components(0, (int)staffspace_h);
+
+      offset_array =
+        find_skew(hfilter, &yproj, param.skew_strip_width,
+                  int(std::min(param.max_skew, staffspace_h)), param.n_threads,
+                  param.workspace);
+    }
+
+    deskew(runs, offset_array, param.skew_strip_width);
+    param.add_deskew_info(offset_array);
+
+    delete offset_array;
+    delete yproj;
+
+    rle_data_type* result_data = new rle_data_type(Dim(original.ncols(), original.nrows()),
+                                                   Point(original.offset_x(), original.offset_y()));
+    rle_view_type* result = new rle_view_type(*result_data);
+    runs.to_image(*result);
+    return result;
+  }
+
   template<class T>
   std::pair<view_type*, view_type*> find_and_remove_staves_fujinaga(T& original, Param& param, Page& page) {
     debug_message("find_and_remove_staves");
 
-    if (param.n_stafflines <= 3) {
+    if (param.n_stafflines > 0 && param.n_stafflines <= 3) {
       throw std::runtime_error
-	("The number of stafflines must be greater than 2.\nAutodetection of the number of stafflines is not implemented.");
+	("The number of stafflines must be greater than 3, or 0 for autodetection.");
     }
 
     //////////////////////////////////////////////////
@@ -1283,11 +2076,14 @@ namespace Aomr {
     // Create the temporaries that we need
     // Remove offsets, which makes all the processing much more straightforward
     // (The offset will be put back at the end right before returning)
+    // Without a workspace from the caller, the temporaries only live for this call
+    FujinagaWorkspace local_workspace;
+    FujinagaWorkspace& workspace = param.workspace ? *param.workspace : local_workspace;
     data_type* image_original_data = new data_type(Dim(original.ncols(), original.nrows()), Point(0, 0));
-    data_type image_hfilter_data(Dim(original.ncols(), original.nrows()), Point(0, 0));
+    WorkspaceImage image_hfilter_data(workspace, Dim(original.ncols(), original.nrows()));
 
     view_type* image_original = new view_type(*image_original_data);
-    view_type image_hfilter(image_hfilter_data);
+    view_type image_hfilter(image_hfilter_data.data());
 
     image_copy_fill(original, *image_original);
     basic_filtering_step(*image_original, image_hfilter, staffline_h, staffspace_h);
@@ -1298,7 +2094,8 @@ namespace Aomr {
     IntVector* offset_array;
     try {
       offset_array = find_skew(image_hfilter, &yproj, param.skew_strip_width, 
-			       (int)(std::min(param.max_skew, staffspace_h)));
+			       (int)(std::min(param.max_skew, staffspace_h)), param.n_threads,
+			       &workspace);
     } catch (std::exception) {
       delete image_original->data(); delete image_original;
       throw;
@@ -1341,8 +2138,7 @@ namespace Aomr {
 	throw;
       }
 
-      param.undo_deskews(*image_original);
-      param.undo_deskews(*image_removed);
+      param.undo_deskews(*image_original, *image_removed);
       return pair<view_type*, view_type*>(image_original, image_removed);
     }
   }
@@ -1368,12 +2164,15 @@ namespace Aomr {
     // Create the temporaries that we need
     // Remove offsets, which makes all the processing much more straightforward
     // (The offset will be put back at the end right before returning)
-    data_type image_original_data(Dim(original.ncols(), original.nrows()), Point(0, 0));
-    data_type image_hfilter_data(Dim(original.ncols(), original.nrows()), Point(0, 0));
+    // Without a workspace from the caller, the temporaries only live for this call
+    FujinagaWorkspace local_workspace;
+    FujinagaWorkspace& workspace = param.workspace ? *param.workspace : local_workspace;
+    WorkspaceImage image_original_data(workspace, Dim(original.ncols(), original.nrows()));
+    WorkspaceImage image_hfilter_data(workspace, Dim(original.ncols(), original.nrows()));
     data_type* image_removed_data = new data_type(Dim(original.ncols(), original.nrows()), Point(0, 0));
 
-    view_type image_original(image_original_data);
-    view_type image_hfilter(image_hfilter_data);
+    view_type image_original(image_original_data.data());
+    view_type image_hfilter(image_hfilter_data.data());
     view_type* image_removed = new view_type(*image_removed_data);
 
     image_copy_fill(original, image_original);
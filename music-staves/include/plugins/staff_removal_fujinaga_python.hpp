@@ -122,14 +122,59 @@ Aomr::Page page_from_python(Rect& original, PyObject* py_page) {
   return page;
 }
 
+static char fujinaga_workspace_desc[] = "FujinagaWorkspace";
+
+void fujinaga_workspace_destructor(void* workspace, void*) {
+  delete (Aomr::FujinagaWorkspace*)workspace;
+}
+
+// Returns NULL for None
+Aomr::FujinagaWorkspace* workspace_from_python(PyObject* py_workspace) {
+  if (py_workspace == NULL || py_workspace == Py_None)
+    return NULL;
+  if (!PyCObject_Check(py_workspace) ||
+      PyCObject_GetDesc(py_workspace) != (void*)fujinaga_workspace_desc)
+    throw std::runtime_error("Invalid FujinagaWorkspace");
+  return (Aomr::FujinagaWorkspace*)PyCObject_AsVoidPtr(py_workspace);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// WORKSPACE FUNCTIONS
+
+PyObject* create_fujinaga_workspace() {
+  return PyCObject_FromVoidPtrAndDesc(new Aomr::FujinagaWorkspace(), fujinaga_workspace_desc,
+				      fujinaga_workspace_destructor);
+}
+
+PyObject* fujinaga_workspace_statistics(PyObject* py_workspace) {
+  Aomr::FujinagaWorkspace* workspace = workspace_from_python(py_workspace);
+  if (workspace == NULL)
+    throw std::runtime_error("Invalid FujinagaWorkspace");
+  return Py_BuildValue("{s:k,s:k,s:k,s:k,s:k}",
+		       "allocated_bytes", (unsigned long)workspace->allocated_bytes,
+		       "peak_bytes", (unsigned long)workspace->peak_bytes,
+		       "in_use_bytes", (unsigned long)workspace->in_use_bytes,
+		       "allocations", (unsigned long)workspace->allocations,
+		       "reuses", (unsigned long)workspace->reuses);
+}
+
+void fujinaga_workspace_clear(PyObject* py_workspace) {
+  Aomr::FujinagaWorkspace* workspace = workspace_from_python(py_workspace);
+  if (workspace == NULL)
+    throw std::runtime_error("Invalid FujinagaWorkspace");
+  workspace->clear();
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////
 // TOP-LEVEL FUNCTIONS
 
 template<class T>
-Aomr::view_type* global_staffline_deskew(T& original, double staffline_h = 0.0, 
-					 double staffspace_h = 0.0, size_t skew_strip_width = 0, 
-					 double max_skew = 8.0) {
+Image* global_staffline_deskew(T& original, double staffline_h = 0.0, 
+			       double staffspace_h = 0.0, size_t skew_strip_width = 0, 
+			       double max_skew = 8.0, bool rle = false) {
   Aomr::Param param(0, 0, staffline_h, staffspace_h, skew_strip_width, max_skew, false);
+  if (rle)
+    return Aomr::global_staffline_deskew_rle(original, param);
   return Aomr::global_staffline_deskew(original, param);
 }
 
@@ -138,10 +183,12 @@ PyObject* find_and_remove_staves_fujinaga(T& original, size_t crossing_symbols,
 					  double staffline_h, double staffspace_h, 
 					  size_t skew_strip_width, double max_skew,
 					  bool deskew_only, bool find_only,
-                                          bool undo_deskew) {
+                                          bool undo_deskew, int n_threads,
+					  PyObject* py_workspace) {
 
   Aomr::Param param(crossing_symbols, n_stafflines, staffline_h, staffspace_h, skew_strip_width, 
-		    max_skew, deskew_only, find_only, undo_deskew);
+		    max_skew, deskew_only, find_only, undo_deskew, n_threads,
+		    workspace_from_python(py_workspace));
   Aomr::Page page;
 
   std::pair<Aomr::view_type*, Aomr::view_type*> result_images = Aomr::find_and_remove_staves_fujinaga
@@ -170,11 +217,13 @@ PyObject* find_and_remove_staves_fujinaga(T& original, size_t crossing_symbols,
 
 template<class T>
 Aomr::view_type* remove_staves_fujinaga(T& original, PyObject* py_page, size_t crossing_symbols,
-				 double staffline_h, double staffspace_h) {
+				 double staffline_h, double staffspace_h,
+				 PyObject* py_workspace) {
   Aomr::Param param;
   param.crossing_symbols = crossing_symbols;
   param.staffline_h = staffline_h;
   param.staffspace_h = staffspace_h;
+  param.workspace = workspace_from_python(py_workspace);
 
   Aomr::Page page = page_from_python(original, py_page);
 
@@ -27,20 +27,41 @@ using namespace std;
 #include <gamera.hpp>
 
 #include <math.h>
+#include <limits.h>
 #include <vector>
+#include <map>
+
+#include "musicstaves_parallel.hpp"
 
 struct angle_t {
   double alpha;
   double tan_alpha;
 };
 
+// the digital lines of one angle, see __chord_lines
+struct chord_lines_t {
+  bool x_major;
+  int n_major, n_minor;
+  float one_step;
+  int limit_factor;
+  vector<int> offset;
+};
+
+// the longest chords of the black pixels over some of the angles and
+// the scratch run lengths of __directional_runs
+struct chord_maxima_t {
+  vector<unsigned int> run;
+  vector<unsigned int> length;
+  vector<size_t> index;
+};
+
 /*
  * prototype declaration
  */
 template<class T>
 ImageList* compute_longest_chord_vectors(const T& image,
-    const int path_length, double resolution=3.0,
-    ProgressBar progress_bar=ProgressBar());
+    const int path_length, double resolution=3.0, int n_threads=1,
+    bool directional_runs=false, ProgressBar progress_bar=ProgressBar());
 
 template<class T>
 RGBImageView* angles_to_RGB(const T& image, const ImageVector v_images,
@@ -54,6 +75,29 @@ static double __get_angle_of_longest_chord(const T& image, size_t col,
 template<class T>
 static unsigned int __runlength(const T& image, size_t x, size_t y,
     struct angle_t, size_t limit);
+static void __chord_direction(struct angle_t angle, float* dx, float* dy);
+static void __chord_steps(const vector<struct angle_t>& angles, size_t limit,
+    size_t extent, bool y_axis, vector<int>& pool, vector<size_t>& index);
+template<class T>
+static void __compute_longest_chords(const T& image, size_t limit,
+    const vector<struct angle_t>& angles, FloatImageView* v_image,
+    FloatImageView* lengths, FloatImageView* thicknesses, int n_threads,
+    ProgressBar& progress_bar);
+static void __chord_lines(struct angle_t angle, size_t limit, size_t ncols,
+    size_t nrows, struct chord_lines_t* lines);
+static bool __longer_chord(unsigned int length_a, size_t a,
+    unsigned int length_b, size_t b, const vector<struct angle_t>& angles);
+static void __directional_runs(const vector<int>& black_id,
+    const vector<Point>& pixels, const vector<int>& order,
+    const struct chord_lines_t& lines, const vector<struct angle_t>& angles,
+    size_t a, size_t ncols, struct chord_maxima_t* maxima);
+static unsigned int __line_runlength(const vector<int>& black_id,
+    const struct chord_lines_t& lines, size_t ncols, size_t col, size_t row);
+template<class T>
+static void __compute_directional_chords(const T& image, size_t limit,
+    const vector<struct angle_t>& angles, FloatImageView* v_image,
+    FloatImageView* lengths, FloatImageView* thicknesses, int n_threads,
+    ProgressBar& progress_bar);
 static Rgb<GreyScalePixel> __set_Hsv(FloatPixel h, FloatPixel s=1.0,
     FloatPixel v=1.0);
 template<class T>
@@ -76,7 +120,8 @@ static void __create_Rgb_3(const T& image, RGBImageView* rgb_image,
  ****************************************************************************/
 template<class T>
 ImageList* compute_longest_chord_vectors(const T& image,
-    const int path_length, double resolution, ProgressBar progress_bar)
+    const int path_length, double resolution, int n_threads,
+    bool directional_runs, ProgressBar progress_bar)
 {
   FloatImageData* v_image_data=new FloatImageData(
       Dim(image.ncols(), image.nrows()),
@@ -93,12 +138,7 @@ ImageList* compute_longest_chord_vectors(const T& image,
       Point(image.offset_x(), image.offset_y()));
   FloatImageView* thicknesses=new FloatImageView(*thicknesses_data);
 
-  typename T::value_type black_value=black(image);
-
-  size_t length;
-  size_t thickness;
   double d_alpha;
-  double min_alpha;
 
   vector<struct angle_t> angles;
   struct angle_t pre_calc_angle;
@@ -116,35 +156,16 @@ ImageList* compute_longest_chord_vectors(const T& image,
     angles.push_back(pre_calc_angle);
   }
 
-  progress_bar.set_length(image.nrows());
-
   /*
    * go through all the angles and compute the
-   * runlength for this pixel
+   * runlength for each black pixel
    */
-  for (size_t row=0; row < image.nrows(); row++) {
-    for (size_t col=0; col < image.ncols(); col++) {
-
-      // ignore white pixels from here on
-      if (image.get(Point(col, row)) != black_value)
-        continue;
-
-      min_alpha=__get_angle_of_longest_chord(image, col, row, path_length,
-          angles, &length, &thickness);
-
-      v_image->set(Point(col, row), min_alpha);
-      lengths->set(Point(col, row), length);
-      thicknesses->set(Point(col, row), thickness);
-    }
-    progress_bar.step();
-#if DEBUG
-    std::cerr << "\rrow " << row+1 << "/" << image.nrows();
-    //std::cerr << std::endl;
-#endif
-  }
-#if DEBUG
-  std::cerr << std::endl;
-#endif
+  if (directional_runs)
+    __compute_directional_chords(image, path_length, angles, v_image,
+        lengths, thicknesses, n_threads, progress_bar);
+  else
+    __compute_longest_chords(image, path_length, angles, v_image, lengths,
+        thicknesses, n_threads, progress_bar);
 
   ImageList* result=new ImageList();
   result->push_back(v_image);
@@ -236,28 +257,7 @@ unsigned int __runlength(const T& image, size_t center_x, size_t center_y,
   /*
    * compute directions where to go
    */
-  if (angle.alpha < 0.)
-    angle.alpha+=2*M_PI;
-
-  if (angle.alpha <= M_PI_4 || angle.alpha > 7*M_PI_4) {
-    dx=1.;
-    dy=angle.tan_alpha;
-  } else if (angle.alpha <= 3*M_PI_4) {
-    if (fabs(angle.alpha-M_PI_2) < 0.0001)
-      dx=0.;
-    else
-      dx=1./angle.tan_alpha;
-    dy=1;
-  } else if (angle.alpha <= 5*M_PI_4) {
-    dx=-1.;
-    dy=-angle.tan_alpha;
-  } else {
-    if (fabs(angle.alpha-3*M_PI_2) < 0.0001)
-      dx=0.;
-    else
-      dx=-1./angle.tan_alpha;
-    dy=-1.;
-  }
+  __chord_direction(angle, &dx, &dy);
 
   ncols=image.ncols();
   nrows=image.nrows();
@@ -309,6 +309,411 @@ unsigned int __runlength(const T& image, size_t center_x, size_t center_y,
   return (size_t)(one_step*length_factor);
 }
 
+/*****************************************************************************
+ * Computes the step of __runlength for 'angle': one pixel in x direction
+ * and 'dy' in y direction (or vice versa for steep angles).
+ ****************************************************************************/
+void __chord_direction(struct angle_t angle, float* dx, float* dy)
+{
+  if (angle.alpha < 0.)
+    angle.alpha+=2*M_PI;
+
+  if (angle.alpha <= M_PI_4 || angle.alpha > 7*M_PI_4) {
+    *dx=1.;
+    *dy=angle.tan_alpha;
+  } else if (angle.alpha <= 3*M_PI_4) {
+    if (fabs(angle.alpha-M_PI_2) < 0.0001)
+      *dx=0.;
+    else
+      *dx=1./angle.tan_alpha;
+    *dy=1;
+  } else if (angle.alpha <= 5*M_PI_4) {
+    *dx=-1.;
+    *dy=-angle.tan_alpha;
+  } else {
+    if (fabs(angle.alpha-3*M_PI_2) < 0.0001)
+      *dx=0.;
+    else
+      *dx=-1./angle.tan_alpha;
+    *dy=-1.;
+  }
+}
+
+/*****************************************************************************
+ * Precomputes the x (or y, when 'y_axis' is set) coordinates that
+ * __runlength visits for every angle, both trace directions and every
+ * center coordinate 0 <= c < 'extent'.
+ *
+ * The coordinates are computed with exactly the same float arithmetic
+ * as in __runlength and stored relative to c. Coordinates outside of
+ * [0, extent) are stored as INT_MIN, so that the trace stops there. As
+ * the float rounding only changes at a few coordinates, most sequences
+ * are equal; they are stored only once in 'pool'. The sequence of angle
+ * a, direction d (0 forward, 1 backward) and center c starts at
+ * pool[index[(a*2 + d)*extent + c]].
+ ****************************************************************************/
+void __chord_steps(const vector<struct angle_t>& angles, size_t limit,
+    size_t extent, bool y_axis, vector<int>& pool, vector<size_t>& index)
+{
+  map<vector<int>, size_t> known;
+  index.resize(angles.size() * 2 * extent);
+  pool.clear();
+
+  for (size_t a=0; a < angles.size(); a++) {
+    float dx, dy;
+    __chord_direction(angles[a], &dx, &dy);
+    float one_step=sqrt(dx*dx+dy*dy);
+    int limit_factor=(int)::round(limit/one_step);
+    size_t n_steps=(limit_factor > 1) ? limit_factor-1 : 0;
+
+    for (int d=0; d < 2; d++) {
+      // the step as it is added in __runlength
+      float step=y_axis ? (d == 0 ? -dy : dy) : (d == 0 ? dx : -dx);
+      vector<int> steps(n_steps), previous;
+      size_t previous_index=0;
+
+      for (size_t c=0; c < extent; c++) {
+        float pos=c+step+0.5f;
+        for (size_t k=0; k < n_steps; k++) {
+          size_t p=(size_t)(pos);
+          steps[k]=(p < extent) ? int(p)-int(c) : INT_MIN;
+          pos+=step;
+        }
+        if (steps != previous) {
+          map<vector<int>, size_t>::iterator i=known.find(steps);
+          if (i == known.end()) {
+            i=known.insert(make_pair(steps, pool.size())).first;
+            pool.insert(pool.end(), steps.begin(), steps.end());
+          }
+          previous=steps;
+          previous_index=i->second;
+        }
+        index[(a*2+d)*extent+c]=previous_index;
+      }
+    }
+  }
+  // all sequences may be empty
+  pool.push_back(INT_MIN);
+}
+
+/*****************************************************************************
+ * The same as calling __get_angle_of_longest_chord for every black pixel
+ * of 'image' and storing the results in 'v_image', 'lengths' and
+ * 'thicknesses'.
+ *
+ * The pixels visited by __runlength are looked up in the tables of
+ * __chord_steps, and the black pixels are looked up in a byte map of the
+ * image. The rows are distributed among 'n_threads' threads in batches,
+ * so that the progress bar can be updated in between.
+ ****************************************************************************/
+template<class T>
+void __compute_longest_chords(const T& image, size_t limit,
+    const vector<struct angle_t>& angles, FloatImageView* v_image,
+    FloatImageView* lengths, FloatImageView* thicknesses, int n_threads,
+    ProgressBar& progress_bar)
+{
+  typename T::value_type black_value=black(image);
+  size_t ncols=image.ncols();
+  size_t nrows=image.nrows();
+  size_t angles_size=angles.size();
+
+  vector<unsigned char> is_black_pixel(ncols*nrows);
+  typename T::const_row_iterator row_iter=image.row_begin();
+  for (size_t row=0; row < nrows; row++, row_iter++) {
+    typename T::const_row_iterator::iterator col_iter=row_iter.begin();
+    for (size_t col=0; col < ncols; col++, col_iter++)
+      is_black_pixel[row*ncols+col]=(*col_iter == black_value);
+  }
+
+  vector<float> one_step(angles_size);
+  vector<int> limit_factor(angles_size);
+  for (size_t a=0; a < angles_size; a++) {
+    float dx, dy;
+    __chord_direction(angles[a], &dx, &dy);
+    one_step[a]=sqrt(dx*dx+dy*dy);
+    limit_factor[a]=(int)::round(limit/one_step[a]);
+  }
+
+  vector<int> x_pool, y_pool;
+  vector<size_t> x_index, y_index;
+  __chord_steps(angles, limit, ncols, false, x_pool, x_index);
+  __chord_steps(angles, limit, nrows, true, y_pool, y_index);
+
+  n_threads=musicstaves_num_threads(n_threads);
+  int batch=n_threads*16;
+  progress_bar.set_length(nrows);
+
+  for (int first_row=0; first_row < int(nrows); first_row+=batch) {
+    int last_row=std::min(first_row+batch, int(nrows));
+#pragma omp parallel num_threads(n_threads)
+    {
+      vector<size_t> chord_length(angles_size);
+
+#pragma omp for schedule(dynamic)
+      for (int row=first_row; row < last_row; row++) {
+        for (size_t col=0; col < ncols; col++) {
+
+          // ignore white pixels from here on
+          if (!is_black_pixel[row*ncols+col])
+            continue;
+
+          size_t length=0;
+          size_t max_index=0;
+          double min_alpha=2*M_PI;
+          for (size_t a=0; a < angles_size; a++) {
+            int length_factor=1;
+            for (int d=0; d < 2; d++) {
+              const int* x_steps=&x_pool[x_index[(a*2+d)*ncols+col]];
+              const int* y_steps=&y_pool[y_index[(a*2+d)*nrows+row]];
+              for (; length_factor < limit_factor[a]; x_steps++, y_steps++) {
+                long x=long(col)+*x_steps;
+                long y=long(row)+*y_steps;
+                if (x < 0 || y < 0 || !is_black_pixel[y*ncols+x])
+                  break;
+                length_factor++;
+              }
+            }
+            unsigned int tmp_length=(size_t)(one_step[a]*length_factor);
+
+            chord_length[a]=tmp_length;
+
+            // the same choice as in __get_angle_of_longest_chord
+            if (tmp_length > length) {
+              length=tmp_length;
+              min_alpha=angles[a].alpha;
+              max_index=a;
+            } else if (tmp_length == length) {
+              if (fabs(angles[a].alpha) < fabs(min_alpha)) {
+                min_alpha=angles[a].alpha;
+                max_index=a;
+              }
+            }
+          }
+
+          v_image->set(Point(col, row), min_alpha);
+          lengths->set(Point(col, row), length);
+          thicknesses->set(Point(col, row),
+              chord_length[(max_index+angles_size/2)%angles_size]);
+        }
+      }
+    }
+    for (int row=first_row; row < last_row; row++)
+      progress_bar.step();
+  }
+}
+
+/*****************************************************************************
+ * Computes the digital lines along which the chords of 'angle' are
+ * measured by __compute_directional_chords. They advance one pixel along
+ * the major axis of the direction of __runlength and (int)(t*slope+0.5)
+ * pixels along the minor axis, so that every pixel lies on exactly one
+ * line: (t, k + offset[t]) are the (major, minor) coordinates of line k.
+ ****************************************************************************/
+void __chord_lines(struct angle_t angle, size_t limit, size_t ncols,
+    size_t nrows, struct chord_lines_t* lines)
+{
+  float dx, dy;
+  __chord_direction(angle, &dx, &dy);
+  lines->one_step=sqrt(dx*dx+dy*dy);
+  lines->limit_factor=std::max((int)::round(limit/lines->one_step), 1);
+
+  lines->x_major=(fabs(dx) >= fabs(dy));
+  lines->n_major=int(lines->x_major ? ncols : nrows);
+  lines->n_minor=int(lines->x_major ? nrows : ncols);
+  double slope=lines->x_major ? -dy/dx : -dx/dy;
+  lines->offset.resize(lines->n_major);
+  for (int t=0; t < lines->n_major; t++)
+    lines->offset[t]=(int)floor(t*slope+0.5);
+}
+
+/*****************************************************************************
+ * Returns whether a chord of length 'length_a' at angle number 'a' is
+ * preferred to a chord of length 'length_b' at angle number 'b'. This is
+ * the choice of __get_angle_of_longest_chord, which keeps the first of the
+ * longest chords with the smallest absolute angle.
+ ****************************************************************************/
+bool __longer_chord(unsigned int length_a, size_t a,
+    unsigned int length_b, size_t b, const vector<struct angle_t>& angles)
+{
+  if (length_a != length_b)
+    return length_a > length_b;
+  if (fabs(angles[a].alpha) != fabs(angles[b].alpha))
+    return fabs(angles[a].alpha) < fabs(angles[b].alpha);
+  return a < b;
+}
+
+/*****************************************************************************
+ * Computes the length of the black run through every black pixel on the
+ * 'lines' of angle number 'a' and keeps it in 'maxima', when it is longer
+ * than the chords of the angles seen before.
+ *
+ * The black pixels are numbered row by row; 'black_id' holds the number of
+ * every pixel (-1 for white pixels), 'pixels' the positions of the black
+ * pixels and 'order' their numbers in the major direction of the lines.
+ * One pass in this order counts the pixels before each pixel in its run,
+ * one pass in the opposite order passes the total down the run.
+ ****************************************************************************/
+void __directional_runs(const vector<int>& black_id,
+    const vector<Point>& pixels, const vector<int>& order,
+    const struct chord_lines_t& lines, const vector<struct angle_t>& angles,
+    size_t a, size_t ncols, struct chord_maxima_t* maxima)
+{
+  vector<unsigned int>& run=maxima->run;
+  run.resize(pixels.size());
+
+  for (size_t i=0; i < order.size(); i++) {
+    int id=order[i];
+    int t=int(lines.x_major ? pixels[id].x() : pixels[id].y());
+    int m=int(lines.x_major ? pixels[id].y() : pixels[id].x());
+    run[id]=1;
+    if (t == 0)
+      continue;
+    m+=lines.offset[t-1]-lines.offset[t];
+    if (m < 0 || m >= lines.n_minor)
+      continue;
+    int previous=black_id[lines.x_major ? size_t(m)*ncols+(t-1) :
+      size_t(t-1)*ncols+m];
+    if (previous >= 0)
+      run[id]=run[previous]+1;
+  }
+
+  for (size_t i=order.size(); i-- > 0; ) {
+    int id=order[i];
+    int t=int(lines.x_major ? pixels[id].x() : pixels[id].y());
+    int m=int(lines.x_major ? pixels[id].y() : pixels[id].x());
+    if (t+1 < lines.n_major) {
+      m+=lines.offset[t+1]-lines.offset[t];
+      if (m >= 0 && m < lines.n_minor) {
+        int next=black_id[lines.x_major ? size_t(m)*ncols+(t+1) :
+          size_t(t+1)*ncols+m];
+        if (next >= 0)
+          run[id]=run[next];
+      }
+    }
+
+    unsigned int length=(size_t)(lines.one_step*
+        std::min(int(run[id]), lines.limit_factor));
+    if (maxima->length[id] == 0 || __longer_chord(length, a,
+          maxima->length[id], maxima->index[id], angles)) {
+      maxima->length[id]=length;
+      maxima->index[id]=a;
+    }
+  }
+}
+
+/*****************************************************************************
+ * Returns the length of the black run through the pixel (col, row) on its
+ * line of 'lines', limited like in __runlength.
+ ****************************************************************************/
+unsigned int __line_runlength(const vector<int>& black_id,
+    const struct chord_lines_t& lines, size_t ncols, size_t col, size_t row)
+{
+  int t=int(lines.x_major ? col : row);
+  int k=int(lines.x_major ? row : col)-lines.offset[t];
+  int length_factor=1;
+
+  for (int d=1; d >= -1; d-=2)
+    for (int u=t+d; u >= 0 && u < lines.n_major &&
+        length_factor < lines.limit_factor; u+=d, length_factor++) {
+      int m=k+lines.offset[u];
+      if (m < 0 || m >= lines.n_minor || black_id[lines.x_major ?
+            size_t(m)*ncols+u : size_t(u)*ncols+m] < 0)
+        break;
+    }
+  return (size_t)(lines.one_step*length_factor);
+}
+
+/*****************************************************************************
+ * Computes 'v_image', 'lengths' and 'thicknesses' like
+ * __compute_longest_chords, but from directional run length transforms:
+ * for each angle, __directional_runs yields the chord lengths of all black
+ * pixels in two passes over them, so that the work does not grow with
+ * 'limit'. Only the thickness is traced for each pixel, along one line.
+ *
+ * The chords follow the digital lines of __chord_lines instead of the
+ * float stepping of __runlength, so that the results may differ in single
+ * pixels. The angles are distributed among 'n_threads' threads, each with
+ * its own maxima, which are merged at the end.
+ ****************************************************************************/
+template<class T>
+void __compute_directional_chords(const T& image, size_t limit,
+    const vector<struct angle_t>& angles, FloatImageView* v_image,
+    FloatImageView* lengths, FloatImageView* thicknesses, int n_threads,
+    ProgressBar& progress_bar)
+{
+  typename T::value_type black_value=black(image);
+  size_t ncols=image.ncols();
+  size_t nrows=image.nrows();
+  size_t angles_size=angles.size();
+
+  // number the black pixels row by row
+  vector<int> black_id(ncols*nrows, -1);
+  vector<Point> pixels;
+  typename T::const_row_iterator row_iter=image.row_begin();
+  for (size_t row=0; row < nrows; row++, row_iter++) {
+    typename T::const_row_iterator::iterator col_iter=row_iter.begin();
+    for (size_t col=0; col < ncols; col++, col_iter++)
+      if (*col_iter == black_value) {
+        black_id[row*ncols+col]=int(pixels.size());
+        pixels.push_back(Point(col, row));
+      }
+  }
+  vector<int> row_order(pixels.size()), col_order;
+  col_order.reserve(pixels.size());
+  for (size_t i=0; i < pixels.size(); i++)
+    row_order[i]=int(i);
+  for (size_t col=0; col < ncols; col++)
+    for (size_t row=0; row < nrows; row++)
+      if (black_id[row*ncols+col] >= 0)
+        col_order.push_back(black_id[row*ncols+col]);
+
+  vector<struct chord_lines_t> lines(angles_size);
+  for (size_t a=0; a < angles_size; a++)
+    __chord_lines(angles[a], limit, ncols, nrows, &lines[a]);
+
+  n_threads=musicstaves_num_threads(n_threads);
+  if (size_t(n_threads) > angles_size)
+    n_threads=std::max(int(angles_size), 1);
+  vector<struct chord_maxima_t> maxima(n_threads);
+  for (int i=0; i < n_threads; i++) {
+    maxima[i].length.assign(pixels.size(), 0);
+    maxima[i].index.assign(pixels.size(), 0);
+  }
+  progress_bar.set_length(angles_size+1);
+
+  for (size_t first=0; first < angles_size; first+=n_threads) {
+    int n=int(std::min(size_t(n_threads), angles_size-first));
+#pragma omp parallel for num_threads(n_threads) schedule(static, 1)
+    for (int i=0; i < n; i++) {
+      size_t a=first+i;
+      __directional_runs(black_id, pixels,
+          lines[a].x_major ? col_order : row_order, lines[a], angles, a,
+          ncols, &maxima[i]);
+    }
+    for (int i=0; i < n; i++)
+      progress_bar.step();
+  }
+
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1024)
+  for (int id=0; id < int(pixels.size()); id++) {
+    unsigned int length=maxima[0].length[id];
+    size_t a=maxima[0].index[id];
+    for (int i=1; i < n_threads; i++)
+      if (maxima[i].length[id] > 0 && __longer_chord(maxima[i].length[id],
+            maxima[i].index[id], length, a, angles)) {
+        length=maxima[i].length[id];
+        a=maxima[i].index[id];
+      }
+
+    const struct chord_lines_t& normal=lines[(a+angles_size/2)%angles_size];
+    v_image->set(pixels[id], angles[a].alpha);
+    lengths->set(pixels[id], length);
+    thicknesses->set(pixels[id], __line_runlength(black_id, normal, ncols,
+          pixels[id].x(), pixels[id].y()));
+  }
+  progress_bar.step();
+}
+
 /*****************************************************************************
  * Converts a Float image into an RGB image, where the information of the
  * Float image is treated as angles in the range of -2*M_PI <= alpha <=
@@ -1,5 +1,6 @@
 #!/usr/bin/env python
 
+import sys
 from distutils.core import setup, Extension
 from gamera import gamera_setup
 
@@ -19,6 +20,21 @@ PLUGIN_PACKAGE = PACKAGE + ".plugins"
 plugins = gamera_setup.get_plugin_filenames(PLUGIN_PATH)
 plugin_extensions = gamera_setup.generate_plugins(plugins, PLUGIN_PACKAGE)
 
+# The multithreaded code paths of the plugins use OpenMP. It is enabled
+# by default with gcc on Linux and can be switched off with --without-openmp.
+# Without OpenMP, all plugins still work but run single-threaded.
+use_openmp = sys.platform.startswith('linux')
+if '--without-openmp' in sys.argv:
+    sys.argv.remove('--without-openmp')
+    use_openmp = False
+if '--with-openmp' in sys.argv:
+    sys.argv.remove('--with-openmp')
+    use_openmp = True
+if use_openmp:
+    for ext in plugin_extensions:
+        ext.extra_compile_args.append('-fopenmp')
+        ext.extra_link_args.append('-fopenmp')
+
 # This is a standard distutils setup initializer.  If you need to do
 # anything more complex here, refer to the Python distutils documentation.
 setup(name=TOOLKIT_NAME, version="1.3.6",